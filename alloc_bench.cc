@@ -0,0 +1,51 @@
+/* block allocator benchmark.
+ * Fill the disk to 90% and measure how fast block_manager can keep
+ * handing out blocks as they are freed and reallocated at random.
+ */
+
+#include "inode_manager.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <vector>
+
+#define FILL_PERCENT 90
+#define ROUNDS 100000
+
+static double
+now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    block_manager *bm = new block_manager();
+    std::vector<blockid_t> ids;
+    unsigned int fill = bm->sb.nblocks / 100 * FILL_PERCENT;
+    unsigned int i, j;
+    double start, elapsed;
+
+    srand(0);
+
+    start = now();
+    for (i = 0; i < fill; i++)
+        ids.push_back(bm->alloc_block());
+    elapsed = now() - start;
+    printf("fill %u blocks: %.0f allocs/s\n", fill, fill / elapsed);
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        j = rand() % fill;
+        bm->free_block(ids[j]);
+        ids[j] = bm->alloc_block();
+    }
+    elapsed = now() - start;
+    printf("free/alloc at %d%% full: %.0f allocs/s\n", FILL_PERCENT,
+            ROUNDS / elapsed);
+
+    delete bm;
+    return 0;
+}
@@ -9,20 +9,45 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <algorithm>
+#include "slock.h"
 
-chfs_client::chfs_client()
+chfs_client::chfs_client(int atime_policy, int wb_expire,
+        uint32_t create_flags)
 {
-    ec = new extent_client();
-
+    ec = new extent_client(atime_policy, wb_expire);
+    this->create_flags = create_flags;
+    init_locks();
 }
 
 chfs_client::chfs_client(std::string extent_dst, std::string lock_dst)
 {
     ec = new extent_client();
+    create_flags = 0;
+    init_locks();
     if (ec->put(1, "") != extent_protocol::OK)
         printf("error init root dir\n"); // XYB: init root dir
 }
 
+// Deleting the extent client writes back what it and the layers
+// below still hold.
+chfs_client::~chfs_client()
+{
+    delete ec;
+    VERIFY(pthread_mutex_destroy(&dcache_m) == 0);
+    for (unsigned i = 0; i < ILOCK_NUM; ++i)
+        VERIFY(pthread_rwlock_destroy(&ilocks[i]) == 0);
+}
+
+void
+chfs_client::init_locks()
+{
+    dcache_bytes = 0;
+    VERIFY(pthread_mutex_init(&dcache_m, NULL) == 0);
+    for (unsigned i = 0; i < ILOCK_NUM; ++i)
+        VERIFY(pthread_rwlock_init(&ilocks[i], NULL) == 0);
+}
+
 chfs_client::inum
 chfs_client::n2i(std::string n)
 {
@@ -40,6 +65,78 @@ chfs_client::filename(inum inum)
     return ost.str();
 }
 
+std::string
+chfs_client::dcache_key(inum parent, const char *name)
+{
+    std::string key((const char *) &parent, sizeof(parent));
+    return key.append(name);
+}
+
+// Look (parent, name) up in the dentry cache. On a hit, found and
+// ino_out are what a lookup would return.
+bool
+chfs_client::dcache_lookup(inum parent, const char *name, bool &found,
+        inum &ino_out)
+{
+    ScopedLock ml(&dcache_m);
+    std::unordered_map<std::string, dentry>::iterator it;
+
+    it = dcache.find(dcache_key(parent, name));
+    if (it == dcache.end())
+        return false;
+    dcache_lru.splice(dcache_lru.begin(), dcache_lru, it->second.lru);
+    found = it->second.ino != 0;
+    ino_out = it->second.ino;
+    return true;
+}
+
+// Record that name in parent is ino, or does not exist if ino is 0,
+// evicting the least recently used entries to stay within budget.
+void
+chfs_client::dcache_insert(inum parent, const char *name, inum ino)
+{
+    ScopedLock ml(&dcache_m);
+    std::string key = dcache_key(parent, name);
+    std::unordered_map<std::string, dentry>::iterator it;
+    size_t cost = 2 * key.size() + sizeof(dentry) + 64;
+
+    it = dcache.find(key);
+    if (it != dcache.end()) {
+        it->second.ino = ino;
+        dcache_lru.splice(dcache_lru.begin(), dcache_lru, it->second.lru);
+        return;
+    }
+
+    while (dcache_bytes + cost > DCACHE_BUDGET && !dcache_lru.empty()) {
+        const std::string &victim = dcache_lru.back();
+        dcache_bytes -= 2 * victim.size() + sizeof(dentry) + 64;
+        dcache.erase(victim);
+        dcache_lru.pop_back();
+    }
+    dcache_lru.push_front(key);
+    dcache[key] = { ino, dcache_lru.begin() };
+    dcache_bytes += cost;
+}
+
+// Drop every entry cached under directory parent, found or not.
+void
+chfs_client::dcache_purge(inum parent)
+{
+    ScopedLock ml(&dcache_m);
+    std::list<std::string>::iterator it = dcache_lru.begin();
+
+    while (it != dcache_lru.end()) {
+        if (it->compare(0, sizeof(parent), (const char *) &parent,
+                    sizeof(parent)) != 0) {
+            ++it;
+            continue;
+        }
+        dcache_bytes -= 2 * it->size() + sizeof(dentry) + 64;
+        dcache.erase(*it);
+        it = dcache_lru.erase(it);
+    }
+}
+
 bool
 chfs_client::isfile(inum inum)
 {
@@ -133,66 +230,462 @@ release:
     } \
 } while (0)
 
-// Only support set size of attr
+// 64-bit FNV-1a hash of a name.
+static uint64_t
+dir_hash(const char *name, unsigned len)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (unsigned i = 0; i < len; ++i) {
+        h ^= (unsigned char) name[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Table slot of hash h at the given depth: its top depth bits.
+static uint32_t
+dir_slot(uint64_t h, uint32_t depth)
+{
+    return depth == 0 ? 0 : (uint32_t) (h >> (64 - depth));
+}
+
+// Offset of the dirent called name among the len bytes of packed
+// dirents at ents, or -1.
+static int
+dirent_find(const char *ents, size_t len, const char *name, unsigned nlen)
+{
+    size_t pos = 0;
+
+    while (pos < len) {
+        const chfs_dirent *d = (const chfs_dirent *) (ents + pos);
+        if (d->name_len == nlen && memcmp(d->name, name, nlen) == 0)
+            return pos;
+        pos += d->rec_len;
+    }
+    return -1;
+}
+
+// Append a dirent for name to ents.
+static void
+dirent_pack(std::string &ents, const char *name, unsigned nlen,
+        uint32_t inum, uint8_t type)
+{
+    char buf[CHFS_DIRENT_SIZE];
+    chfs_dirent *d = (chfs_dirent *) buf;
+
+    memset(buf, 0, sizeof(buf));
+    d->inum = inum;
+    d->name_len = nlen;
+    d->rec_len = 8 + nlen;
+    if (d->rec_len % 4 != 0)
+        d->rec_len += (4 - d->rec_len % 4);
+    d->file_type = type;
+    memcpy(d->name, name, nlen);
+    ents.append(buf, d->rec_len);
+}
+
+// A full bucket holding ents at the given depth.
+static std::string
+dir_mkbucket(const std::string &ents, uint16_t depth)
+{
+    chfs_dirbucket bh;
+    std::string bucket;
+
+    bh.used = ents.size();
+    bh.depth = depth;
+    bucket.assign((const char *) &bh, sizeof(bh));
+    bucket.append(ents);
+    bucket.resize(DIR_BUCKET_SIZE, '\0');
+    return bucket;
+}
+
+// Read the header of directory dir; hashed is false for a linear one.
 int
-chfs_client::setattr(inum ino, size_t size)
+chfs_client::dir_header(inum dir, chfs_dirhash &h, bool &hashed)
 {
     int r = OK;
-    extent_protocol::attr a;
-    std::string sbuf;
+    std::string buf;
 
-    /*
-     * your code goes here.
-     * note: get the content of inode ino, and modify its content
-     * according to the size (<, =, or >) content length.
-     */
+    EXT_RPC(ec->read_range(dir, 0, sizeof(h), buf));
+    hashed = buf.size() == sizeof(h) &&
+        ((const chfs_dirhash *) buf.data())->magic == CHFS_DIRHASH_MAGIC;
+    if (hashed)
+        memcpy(&h, buf.data(), sizeof(h));
 
-    if (ec->getattr(ino, a) != extent_protocol::OK) {
+release:
+    return r;
+}
+
+// Read the bucket of a hashed directory that names hashing to hash
+// belong in, and its offset b.
+int
+chfs_client::dir_bucket(inum dir, const chfs_dirhash &h, uint64_t hash,
+        uint32_t &b, std::string &bucket)
+{
+    int r = OK;
+    std::string buf;
+
+    EXT_RPC(ec->read_range(dir, h.table + 4 * dir_slot(hash, h.depth), 4, buf));
+    if (buf.size() != 4) {
         r = IOERR;
         goto release;
     }
-    if (a.type != extent_protocol::T_FILE) {
-        printf("setattr with size: %lld is not a file\n", ino);
-        r = NOENT;
+    memcpy(&b, buf.data(), 4);
+    EXT_RPC(ec->read_range(dir, b, DIR_BUCKET_SIZE, bucket));
+    bucket.resize(DIR_BUCKET_SIZE, '\0');
+
+release:
+    return r;
+}
+
+// Split the bucket that names hashing to hash belong in: the names
+// whose next hash bit is set move to a new bucket, and the upper
+// half of the table slots pointing at the old one are repointed.
+// The new bucket (and a doubled table) go at the end and the header
+// takes them in before any slot points at the new bucket; the old
+// bucket loses the moved names last.
+int
+chfs_client::dir_split(inum dir, chfs_dirhash &h, uint64_t hash)
+{
+    int r = OK;
+    std::string bucket, table, doubled, lo, hi, slots;
+    const chfs_dirbucket *bh;
+    const chfs_dirent *d;
+    uint32_t b, nb, depth, first, n, i;
+    size_t pos;
+
+    if ((r = dir_bucket(dir, h, hash, b, bucket)) != OK)
         goto release;
-    } 
+    bh = (const chfs_dirbucket *) bucket.data();
+    depth = bh->depth;
 
-    if (size == a.size)
+    if (depth == h.depth) {
+        if (h.depth == DIR_MAX_DEPTH) {
+            printf("dir_split: directory %016llx is full\n", dir);
+            r = IOERR;
+            goto release;
+        }
+        // double the table: slot i becomes slots 2i and 2i + 1
+        EXT_RPC(ec->read_range(dir, h.table, 4 << h.depth, table));
+        for (i = 0; i < (1u << h.depth); ++i) {
+            doubled.append(table, 4 * i, 4);
+            doubled.append(table, 4 * i, 4);
+        }
+        EXT_RPC(ec->write_range(dir, h.end, doubled));
+        h.table = h.end;
+        h.end += doubled.size();
+        h.depth++;
+    }
+
+    for (pos = sizeof(*bh); pos < sizeof(*bh) + bh->used; pos += d->rec_len) {
+        d = (const chfs_dirent *) (bucket.data() + pos);
+        if ((dir_hash(d->name, d->name_len) >> (63 - depth)) & 1)
+            hi.append((const char *) d, d->rec_len);
+        else
+            lo.append((const char *) d, d->rec_len);
+    }
+    nb = h.end;
+    h.end += DIR_BUCKET_SIZE;
+    EXT_RPC(ec->write_range(dir, nb, dir_mkbucket(hi, depth + 1)));
+    EXT_RPC(ec->write_range(dir, 0, std::string((const char *) &h, sizeof(h))));
+
+    first = dir_slot(hash, depth) << (h.depth - depth);
+    n = 1u << (h.depth - depth);
+    for (i = 0; i < n / 2; ++i)
+        slots.append((const char *) &nb, 4);
+    EXT_RPC(ec->write_range(dir, h.table + 4 * (first + n / 2), slots));
+    EXT_RPC(ec->write_range(dir, b, dir_mkbucket(lo, depth + 1)));
+
+release:
+    return r;
+}
+
+// Rebuild linear directory dir, whose content is ents, as a hashed
+// directory: the header, a table and one bucket per slot at the
+// least depth whose buckets hold the entries. The new layout replaces
+// the linear content in a single put, so there is no point at which
+// only some of the entries are in the directory.
+int
+chfs_client::dir_convert(inum dir, const std::string &ents)
+{
+    int r = OK;
+    chfs_dirhash h;
+    std::vector<std::string> parts;
+    std::string image;
+    const chfs_dirent *d;
+    uint32_t depth, i, off;
+    size_t pos;
+
+    for (depth = 0; ; ++depth) {
+        if (depth > DIR_MAX_DEPTH) {
+            printf("dir_convert: directory %016llx does not fit\n", dir);
+            r = IOERR;
+            goto release;
+        }
+        parts.assign(1u << depth, std::string());
+        for (pos = 0; pos < ents.size(); pos += d->rec_len) {
+            d = (const chfs_dirent *) (ents.data() + pos);
+            parts[dir_slot(dir_hash(d->name, d->name_len), depth)].append(
+                    (const char *) d, d->rec_len);
+        }
+        for (i = 0; i < parts.size(); ++i)
+            if (sizeof(chfs_dirbucket) + parts[i].size() > DIR_BUCKET_SIZE)
+                break;
+        if (i == parts.size())
+            break;
+    }
+
+    h.magic = CHFS_DIRHASH_MAGIC;
+    h.depth = depth;
+    h.table = sizeof(h);
+    h.end = h.table + (4 << depth) + parts.size() * DIR_BUCKET_SIZE;
+    image.assign((const char *) &h, sizeof(h));
+    for (i = 0; i < parts.size(); ++i) {
+        off = h.table + (4 << depth) + i * DIR_BUCKET_SIZE;
+        image.append((const char *) &off, 4);
+    }
+    for (i = 0; i < parts.size(); ++i)
+        image.append(dir_mkbucket(parts[i], depth));
+    EXT_RPC(ec->put(dir, image));
+
+release:
+    return r;
+}
+
+// Look name up in directory dir.
+int
+chfs_client::dir_find(inum dir, const char *name, bool &found, inum &ino_out)
+{
+    int r = OK;
+    chfs_dirhash h;
+    bool hashed;
+    std::string sdir;
+    const char *ents;
+    size_t len;
+    uint32_t b;
+    int pos;
+
+    found = false;
+    if ((r = dir_header(dir, h, hashed)) != OK)
         goto release;
+    if (hashed) {
+        if ((r = dir_bucket(dir, h, dir_hash(name, strlen(name)), b, sdir)) != OK)
+            goto release;
+        ents = sdir.data() + sizeof(chfs_dirbucket);
+        len = ((const chfs_dirbucket *) sdir.data())->used;
+    } else {
+        EXT_RPC(ec->get(dir, sdir));
+        ents = sdir.data();
+        len = sdir.size();
+    }
 
-    if (ec->get(ino, sbuf) != extent_protocol::OK) {
-        r = IOERR;
+    pos = dirent_find(ents, len, name, strlen(name));
+    if (pos >= 0) {
+        ino_out = ((const chfs_dirent *) (ents + pos))->inum;
+        found = true;
+    }
+
+release:
+    return r;
+}
+
+// Add an entry for name to directory dir, or return EXIST.
+int
+chfs_client::dir_add(inum dir, const char *name, inum ino, uint8_t type)
+{
+    int r = OK;
+    chfs_dirhash h;
+    chfs_dirbucket *bh;
+    bool hashed;
+    std::string sdir, ent, bucket;
+    unsigned nlen = strlen(name);
+    uint64_t hash;
+    uint32_t b;
+
+    dirent_pack(ent, name, nlen, ino, type);
+    if ((r = dir_header(dir, h, hashed)) != OK)
         goto release;
+
+    if (!hashed) {
+        EXT_RPC(ec->get(dir, sdir));
+        if (dirent_find(sdir.data(), sdir.size(), name, nlen) >= 0) {
+            r = EXIST;
+            goto release;
+        }
+        // small directories stay linear and are appended to
+        if (sdir.size() + ent.size() <= DIR_LINEAR_MAX) {
+            EXT_RPC(ec->write_range(dir, sdir.size(), ent));
+            goto release;
+        }
+        if ((r = dir_convert(dir, sdir)) != OK ||
+            (r = dir_header(dir, h, hashed)) != OK)
+            goto release;
     }
-    if (size < a.size)
-        sbuf.erase(size);
-    else
-        sbuf.append(size - a.size, '\0');
-    if (ec->put(ino, sbuf) != extent_protocol::OK) {
-        r = IOERR;
+
+    hash = dir_hash(name, nlen);
+    for (;;) {
+        if ((r = dir_bucket(dir, h, hash, b, bucket)) != OK)
+            goto release;
+        bh = (chfs_dirbucket *) &bucket[0];
+        if (dirent_find(bucket.data() + sizeof(*bh), bh->used, name, nlen) >= 0) {
+            r = EXIST;
+            goto release;
+        }
+        if (sizeof(*bh) + bh->used + ent.size() <= DIR_BUCKET_SIZE)
+            break;
+        if ((r = dir_split(dir, h, hash)) != OK)
+            goto release;
+    }
+
+    bucket.replace(sizeof(*bh) + bh->used, ent.size(), ent);
+    bh->used += ent.size();
+    EXT_RPC(ec->write_range(dir, b, bucket));
+
+release:
+    return r;
+}
+
+// Remove the entry for name from directory dir, returning its inum
+// and type.
+int
+chfs_client::dir_del(inum dir, const char *name, inum &ino_out,
+        uint8_t &type_out)
+{
+    int r = OK;
+    chfs_dirhash h;
+    chfs_dirbucket *bh;
+    const chfs_dirent *d;
+    bool hashed;
+    std::string sdir;
+    unsigned nlen = strlen(name);
+    uint32_t b;
+    int pos;
+
+    if ((r = dir_header(dir, h, hashed)) != OK)
+        goto release;
+
+    if (!hashed) {
+        EXT_RPC(ec->get(dir, sdir));
+        if ((pos = dirent_find(sdir.data(), sdir.size(), name, nlen)) < 0) {
+            r = NOENT;
+            goto release;
+        }
+        d = (const chfs_dirent *) (sdir.data() + pos);
+        ino_out = d->inum;
+        type_out = d->file_type;
+        sdir.erase(pos, d->rec_len);
+        EXT_RPC(ec->put(dir, sdir));
         goto release;
     }
 
+    if ((r = dir_bucket(dir, h, dir_hash(name, nlen), b, sdir)) != OK)
+        goto release;
+    bh = (chfs_dirbucket *) &sdir[0];
+    if ((pos = dirent_find(sdir.data() + sizeof(*bh), bh->used, name, nlen)) < 0) {
+        r = NOENT;
+        goto release;
+    }
+    d = (const chfs_dirent *) (sdir.data() + sizeof(*bh) + pos);
+    ino_out = d->inum;
+    type_out = d->file_type;
+    bh->used -= d->rec_len;
+    sdir.erase(sizeof(*bh) + pos, d->rec_len);
+    sdir.resize(DIR_BUCKET_SIZE, '\0');
+    EXT_RPC(ec->write_range(dir, b, sdir));
+
 release:
     return r;
 }
 
+// Cookie of a name with hash h: non-zero and within an off_t, as FUSE
+// wants directory offsets, and in the order of the hashes.
+static uint64_t
+dir_cookie(uint64_t h)
+{
+    return (h >> 2) + 1;
+}
+
+static bool
+cookie_less(const chfs_client::dirent &a, const chfs_client::dirent &b)
+{
+    return a.cookie < b.cookie;
+}
+
+// Append to list the entries among the len bytes of packed dirents at
+// ents whose cookies are past cookie, in cookie order.
+static void
+dirents_from(const char *ents, size_t len, uint64_t cookie,
+        std::list<chfs_client::dirent> &list)
+{
+    std::vector<chfs_client::dirent> v;
+    const chfs_dirent *d;
+    uint64_t c;
+    size_t pos;
+
+    for (pos = 0; pos < len; pos += d->rec_len) {
+        d = (const chfs_dirent *) (ents + pos);
+        c = dir_cookie(dir_hash(d->name, d->name_len));
+        if (c > cookie)
+            v.emplace_back(std::string(d->name, d->name_len), d->inum, c);
+    }
+    std::sort(v.begin(), v.end(), cookie_less);
+    list.insert(list.end(), v.begin(), v.end());
+}
+
+// List up to max entries of directory dir whose cookies are past
+// cookie (0 to start), in cookie order. Of a hashed directory, only
+// the buckets from the one holding cookie on are read, and only until
+// max entries are found.
 int
-chfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
+chfs_client::dir_list_from(inum dir, uint64_t cookie, size_t max,
+        std::list<dirent> &list)
 {
     int r = OK;
-    const char *cdir, *pcur;
-    const chfs_dirent *pdir;
-    chfs_dirent *pent;
-    unsigned dsize;
-    unsigned nsz = strlen(name);
+    chfs_dirhash h;
+    bool hashed;
     std::string sdir;
-    /*
-     * your code goes here.
-     * note: lookup is what you need to check if file exist;
-     * after create file or dir, you must remember to modify the parent infomation.
-     */
-    printf("create %s\n", name);
+    const chfs_dirbucket *bh;
+    uint64_t hash;
+    uint32_t i, b;
+
+    if ((r = dir_header(dir, h, hashed)) != OK)
+        goto release;
+
+    if (!hashed) {
+        EXT_RPC(ec->get(dir, sdir));
+        dirents_from(sdir.data(), sdir.size(), cookie, list);
+        goto trim;
+    }
+
+    // a bucket of depth d spans the 1 << (h.depth - d) slots sharing
+    // its top d bits; each one is read once
+    i = cookie == 0 ? 0 : dir_slot((cookie - 1) << 2, h.depth);
+    while (i < (1u << h.depth) && list.size() < max) {
+        hash = h.depth == 0 ? 0 : (uint64_t) i << (64 - h.depth);
+        if ((r = dir_bucket(dir, h, hash, b, sdir)) != OK)
+            goto release;
+        bh = (const chfs_dirbucket *) sdir.data();
+        dirents_from((const char *) (bh + 1), bh->used, cookie, list);
+        i = (i | ((1u << (h.depth - bh->depth)) - 1)) + 1;
+    }
+
+trim:
+    while (list.size() > max)
+        list.pop_back();
+
+release:
+    return r;
+}
+
+// Create an inode of the given type and link it into parent as name.
+int
+chfs_client::dir_create(inum parent, const char *name, uint32_t type,
+        inum &ino_out)
+{
+    ScopedRWLock dl(ilock(parent), true);
+    int r = OK;
+    unsigned nsz = strlen(name);
 
     if (!isdir(parent)) {
         r = NOENT;
@@ -205,45 +698,51 @@ chfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
         goto release;
     }
 
-    // lookup name in parent dir
     ino_out = 0;
-    if (ec->get(parent, sdir) != extent_protocol::OK) {
+    if (ec->create(type, ino_out, create_flags) != extent_protocol::OK) {
         r = IOERR;
         goto release;
     }
+    // the entry is checked for and added in one pass over the parent
+    if ((r = dir_add(parent, name, ino_out, type)) != OK) {
+        ec->remove(ino_out);
+        ino_out = 0;
+        goto release;
+    }
+    dcache_insert(parent, name, ino_out);
 
-    dsize = sdir.size();
-    cdir = sdir.c_str();
-    pcur = cdir;
+release:
+    return r;
+}
 
-    while (pcur < cdir + dsize) {
-        pdir = (const chfs_dirent *) pcur;
-        if (strncmp(name, pdir->name, pdir->name_len) == 0) {
-            r = EXIST;
-            goto release;
-        }
-        pcur += pdir->rec_len;
-    }
+// Only support set size of attr
+int
+chfs_client::setattr(inum ino, size_t size)
+{
+    int r = OK;
+    extent_protocol::attr a;
+
+    /*
+     * your code goes here.
+     * note: get the content of inode ino, and modify its content
+     * according to the size (<, =, or >) content length.
+     */
 
-    // alloc inode
-    if (ec->create(extent_protocol::T_FILE, ino_out) != extent_protocol::OK) {
+    if (ec->getattr(ino, a) != extent_protocol::OK) {
         r = IOERR;
         goto release;
     }
+    if (a.type != extent_protocol::T_FILE) {
+        printf("setattr with size: %lld is not a file\n", ino);
+        r = NOENT;
+        goto release;
+    } 
 
-    // update parent dir
-    char new_ent[CHFS_DIRENT_SIZE];
-    pent = (chfs_dirent *) new_ent;
-    pent->inum = ino_out;
-    pent->name_len = nsz;
-    pent->rec_len = 8 + pent->name_len;
-    if (pent->rec_len % 4 != 0)
-        pent->rec_len += (4 - pent->rec_len % 4);
-    pent->file_type = extent_protocol::T_FILE;
-    memcpy(pent->name, name, nsz);
+    if (size == a.size)
+        goto release;
 
-    sdir.append(new_ent, pent->rec_len);
-    if (ec->put(parent, sdir) != extent_protocol::OK) {
+    // growing leaves a hole, so this costs the same for any size
+    if (ec->truncate(ino, size) != extent_protocol::OK) {
         r = IOERR;
         goto release;
     }
@@ -253,27 +752,36 @@ release:
 }
 
 int
-chfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
+chfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
 {
-    int r = OK;
+    /*
+     * your code goes here.
+     * note: lookup is what you need to check if file exist;
+     * after create file or dir, you must remember to modify the parent infomation.
+     */
+    printf("create %s\n", name);
+
+    return dir_create(parent, name, extent_protocol::T_FILE, ino_out);
+}
 
+int
+chfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
+{
     /*
      * your code goes here.
      * note: lookup is what you need to check if directory exist;
      * after create file or dir, you must remember to modify the parent infomation.
      */
+    printf("mkdir %s\n", name);
 
-    return r;
+    return dir_create(parent, name, extent_protocol::T_DIR, ino_out);
 }
 
 int
 chfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
 {
+    ScopedRWLock dl(ilock(parent), false);
     int r = OK;
-    const char *cdir, *pcur;
-    const chfs_dirent *pdir;
-    unsigned dsize;
-    std::string sdir;
     /*
      * your code goes here.
      * note: lookup file from parent dir according to name;
@@ -281,6 +789,9 @@ chfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
      */
     printf("lookup %s\n", name);
 
+    if (dcache_lookup(parent, name, found, ino_out))
+        goto release;
+
     if (!isdir(parent)) {
         r = NOENT;
         goto release;
@@ -288,66 +799,29 @@ chfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
 
     found = false;
     ino_out = 0;
-    if (ec->get(parent, sdir) != extent_protocol::OK) {
-        r = IOERR;
-        goto release;
-    }
-
-    dsize = sdir.size();
-    cdir = sdir.c_str();
-    pcur = cdir;
-
-    while (pcur < cdir + dsize) {
-        pdir = (const chfs_dirent *) pcur;
-        if (strncmp(name, pdir->name, pdir->name_len) == 0) {
-            ino_out = pdir->inum;
-            found = true;
-            break;
-        }
-        pcur += pdir->rec_len;
-    }
+    r = dir_find(parent, name, found, ino_out);
+    if (r == OK)
+        dcache_insert(parent, name, found ? ino_out : 0);
 
 release:
     return r;
 }
 
+// Read directory dir from cookie on, at most max entries at a time.
 int
-chfs_client::readdir(inum dir, std::list<dirent> &list)
+chfs_client::readdir(inum dir, uint64_t cookie, size_t max,
+        std::list<dirent> &list)
 {
-    int r = OK;
-    const char *cdir, *pcur;
-    const chfs_dirent *pdir;
-    unsigned dsize;
-    /*
-     * your code goes here.
-     * note: you should parse the dirctory content using your defined format,
-     * and push the dirents to the list.
-     */
-    printf("readdir %016llx\n", dir);
-
-    std::string sdir;
-    if (ec->get(dir, sdir) != extent_protocol::OK) {
-        r = IOERR;
-        goto release;
-    }
-
-    dsize = sdir.size();
-    cdir = sdir.c_str();
-    pcur = cdir;
-
-    while (pcur < cdir + dsize) {
-        pdir = (const chfs_dirent *) pcur;
-        std::string ename(pdir->name, pdir->name_len);
-        list.emplace_back(ename, pdir->inum);
-        pcur += pdir->rec_len;
-    }
+    printf("readdir %016llx from %016llx\n", dir,
+            (unsigned long long) cookie);
 
-release:
-    return r;
+    ScopedRWLock dl(ilock(dir), false);
+    return dir_list_from(dir, cookie, max, list);
 }
 
 int
-chfs_client::read(inum ino, size_t size, off_t off, std::string &data)
+chfs_client::read(inum ino, size_t size, off_t off, std::string &data,
+                  uint64_t fh)
 {
     int r = OK;
 
@@ -359,16 +833,18 @@ chfs_client::read(inum ino, size_t size, off_t off, std::string &data)
         r = NOENT;
         goto release;
     }
-    if (ec->get(ino, data) != extent_protocol::OK) {
+    // reads through an open file handle go through the page cache
+    // and its readahead
+    if (fh != 0) {
+        if (ec->read(fh, off, size, data) != extent_protocol::OK)
+            r = IOERR;
+        goto release;
+    }
+    if (ec->read_range(ino, off, size, data) != extent_protocol::OK) {
         r = IOERR;
         goto release;
     }
 
-    if (static_cast<long unsigned>(off) > data.size())
-        data = "";
-    else
-        data = data.substr(off, size);
-
 release:
     return r;
 }
@@ -378,7 +854,6 @@ chfs_client::write(inum ino, size_t size, off_t off, const char *data,
         size_t &bytes_written)
 {
     int r = OK;
-    std::string sbuf;
 
     /*
      * your code goes here.
@@ -389,38 +864,105 @@ chfs_client::write(inum ino, size_t size, off_t off, const char *data,
         r = NOENT;
         goto release;
     }
-    if (ec->get(ino, sbuf) != extent_protocol::OK) {
+    // only the blocks under [off, off + size) are written; a gap past
+    // the end of file reads back as '\0'
+    if (ec->write_range(ino, off, std::string(data, size)) != extent_protocol::OK) {
         r = IOERR;
         goto release;
     }
-
     bytes_written = size;
-    if (static_cast<long unsigned>(off) < sbuf.size())
-        sbuf.erase(off, size);
-    else if (static_cast<long unsigned>(off) > sbuf.size()) {
-        sbuf.append(off - sbuf.size(), '\0');
-        bytes_written += off - sbuf.size();
-    }
-    sbuf.insert(off, data, size);
 
-    if (ec->put(ino, sbuf) != extent_protocol::OK) {
+release:
+    return r;
+}
+
+int
+chfs_client::fsync(inum ino)
+{
+    int r = OK;
+
+    if (ec->sync(ino) != extent_protocol::OK)
+        r = IOERR;
+
+    return r;
+}
+
+// Give an open file a handle, which carries its readahead state.
+int
+chfs_client::open(inum ino, uint64_t &fh)
+{
+    unsigned long long h;
+
+    if (ec->open(ino, h) != extent_protocol::OK)
+        return IOERR;
+    fh = h;
+    return OK;
+}
+
+// Write out what is held back of the file's data, on its last close,
+// and drop the handle.
+int
+chfs_client::release(inum ino, uint64_t fh)
+{
+    int r = OK;
+
+    if (fh != 0)
+        ec->close(fh);
+    if (ec->flush(ino) != extent_protocol::OK)
         r = IOERR;
-        goto release;
-    }
 
-release:
     return r;
 }
 
+int
+chfs_client::statfs(fsinfo &fs)
+{
+    extent_protocol::fsstat s;
+
+    if (ec->statfs(s) != extent_protocol::OK)
+        return IOERR;
+    fs.bsize = s.bsize;
+    fs.blocks = s.blocks;
+    fs.bfree = s.bfree;
+    fs.files = s.files;
+    fs.ffree = s.ffree;
+    return OK;
+}
+
 int chfs_client::unlink(inum parent,const char *name)
 {
+    ScopedRWLock dl(ilock(parent), true);
     int r = OK;
+    inum ino;
+    uint8_t type;
 
     /*
      * your code goes here.
      * note: you should remove the file using ec->remove,
      * and update the parent directory content.
      */
+    printf("unlink %s\n", name);
 
+    if (!isdir(parent)) {
+        r = NOENT;
+        goto release;
+    }
+    if ((r = dir_del(parent, name, ino, type)) != OK)
+        goto release;
+    dcache_insert(parent, name, 0);
+    if (ec->remove(ino) != extent_protocol::OK)
+        r = IOERR;
+    // the inum may be reused for a new directory at once
+    if (type == extent_protocol::T_DIR)
+        dcache_purge(ino);
+
+release:
     return r;
 }
+
+// Log the cache counters of the layers below.
+void
+chfs_client::print_stats()
+{
+    ec->print_stats();
+}
@@ -5,6 +5,9 @@
 //#include "chfs_protocol.h"
 #include "extent_client.h"
 #include <vector>
+#include <list>
+#include <unordered_map>
+#include <pthread.h>
 
 const unsigned CHFS_NAME_LEN = 255;
 
@@ -18,8 +21,57 @@ struct chfs_dirent {
 
 const unsigned CHFS_DIRENT_SIZE = 264;
 
+// A directory starts out linear: its content is packed chfs_dirents.
+// Once that grows past DIR_LINEAR_MAX bytes it is rebuilt as a hashed
+// directory (extendible hashing on a 64-bit FNV-1a hash of the name):
+//   [0, ...)               struct chfs_dirhash
+//   [table, ...)           1 << depth uint32 bucket offsets, indexed
+//                          by the top depth bits of the hash
+//   elsewhere              DIR_BUCKET_SIZE byte buckets: struct
+//                          chfs_dirbucket, then packed chfs_dirents
+// so a lookup reads one table slot and one bucket. A full bucket is
+// split in two, doubling the table if it is already at full depth.
+// New buckets and doubled tables are appended at end, and the header
+// is rewritten before anything points at them, so the file stays
+// about as large as its buckets and a directory is never half moved.
+//
+// Directories are read out in hash order, a bucket at a time. The
+// cookie of an entry, from which a listing resumes, is derived from
+// its hash, so it stays valid while other names come and go and
+// buckets split.
+const uint32_t CHFS_DIRHASH_MAGIC = 0x68736863;  // "chsh"
+const unsigned DIR_LINEAR_MAX = 2048;
+const unsigned DIR_BUCKET_SIZE = 1024;
+const unsigned DIR_MAX_DEPTH = 20;
+
+struct chfs_dirhash {
+  uint32_t magic;
+  uint32_t depth;     // global depth
+  uint32_t table;     // offset of the bucket table
+  uint32_t end;       // where the next bucket or table goes
+};
+
+struct chfs_dirbucket {
+  uint16_t used;      // bytes of dirents that follow
+  uint16_t depth;     // hash bits shared by its names
+};
+
+// Lookups are cached per (parent, name), including names that were
+// not found, within DCACHE_BUDGET bytes; the least recently used
+// entries are dropped first. Only this client's create, mkdir and
+// unlink are seen. Removing a directory drops everything cached under
+// it, since its inum is soon handed out again.
+const size_t DCACHE_BUDGET = 1 << 20;
+
+// Directory operations may run in several threads at once. Each
+// directory is guarded by one of ILOCK_NUM rwlocks, picked by inum:
+// lookup and readdir hold it shared, create, mkdir and unlink
+// exclusively, so a change to a directory is never seen half done.
+const unsigned ILOCK_NUM = 64;
+
 class chfs_client {
   extent_client *ec;
+  uint32_t create_flags;  // extent_protocol::create_flags of new inodes
  public:
 
   typedef unsigned long long inum;
@@ -37,20 +89,60 @@ class chfs_client {
     unsigned long mtime;
     unsigned long ctime;
   };
+  struct fsinfo {
+    unsigned long bsize;
+    unsigned long blocks;
+    unsigned long bfree;
+    unsigned long files;
+    unsigned long ffree;
+  };
   struct dirent {
     std::string name;
     chfs_client::inum inum;
+    uint64_t cookie;  // where a listing resumes after this entry
     dirent() = default;
-    dirent(const std::string &s, chfs_client::inum i): name(s), inum(i) { }
+    dirent(const std::string &s, chfs_client::inum i, uint64_t c = 0):
+      name(s), inum(i), cookie(c) { }
   };
 
  private:
   static std::string filename(inum);
   static inum n2i(std::string);
+  void init_locks();
+
+  int dir_header(inum, chfs_dirhash &, bool &);
+  int dir_bucket(inum, const chfs_dirhash &, uint64_t, uint32_t &,
+                 std::string &);
+  int dir_split(inum, chfs_dirhash &, uint64_t);
+  int dir_convert(inum, const std::string &);
+  int dir_find(inum, const char *, bool &, inum &);
+  int dir_add(inum, const char *, inum, uint8_t);
+  int dir_del(inum, const char *, inum &, uint8_t &);
+  int dir_list_from(inum, uint64_t, size_t, std::list<dirent> &);
+  int dir_create(inum, const char *, uint32_t, inum &);
+
+  struct dentry {
+    inum ino;  // 0 for a name known not to exist
+    std::list<std::string>::iterator lru;
+  };
+  std::unordered_map<std::string, dentry> dcache;
+  std::list<std::string> dcache_lru;  // most recently used first
+  size_t dcache_bytes;
+  pthread_mutex_t dcache_m;  // protects dcache, dcache_lru, dcache_bytes
+
+  pthread_rwlock_t ilocks[ILOCK_NUM];
+  pthread_rwlock_t *ilock(inum i) { return &ilocks[i % ILOCK_NUM]; }
+
+  static std::string dcache_key(inum, const char *);
+  bool dcache_lookup(inum, const char *, bool &, inum &);
+  void dcache_insert(inum, const char *, inum);
+  void dcache_purge(inum);
 
  public:
-  chfs_client();
+  chfs_client(int atime_policy = extent_protocol::STRICTATIME,
+              int wb_expire = WCACHE_EXPIRE, uint32_t create_flags = 0);
   chfs_client(std::string, std::string);
+  ~chfs_client();
 
   bool isfile(inum);
   bool isdir(inum);
@@ -61,11 +153,16 @@ class chfs_client {
   int setattr(inum, size_t);
   int lookup(inum, const char *, bool &, inum &);
   int create(inum, const char *, mode_t, inum &);
-  int readdir(inum, std::list<dirent> &);
+  int readdir(inum, uint64_t, size_t, std::list<dirent> &);
   int write(inum, size_t, off_t, const char *, size_t &);
-  int read(inum, size_t, off_t, std::string &);
+  int open(inum, uint64_t &);
+  int read(inum, size_t, off_t, std::string &, uint64_t fh = 0);
   int unlink(inum,const char *);
   int mkdir(inum , const char *, mode_t , inum &);
+  int fsync(inum);
+  int release(inum, uint64_t);
+  int statfs(fsinfo &);
+  void print_stats();
   
   /** you may need to add symbolic link related methods here.*/
 };
@@ -3,20 +3,367 @@
 #include "extent_client.h"
 #include <sstream>
 #include <iostream>
+#include <vector>
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/time.h>
+#include "slock.h"
+#include "method_thread.h"
 
-extent_client::extent_client()
+extent_client::extent_client(int atime_policy, int wb_expire)
 {
-  es = new extent_server();
+  es = new extent_server(atime_policy);
+  VERIFY(pthread_mutex_init(&m, NULL) == 0);
+  VERIFY(pthread_cond_init(&flusher_cond, NULL) == 0);
+  VERIFY(pthread_cond_init(&flush_cond, NULL) == 0);
+  VERIFY(pthread_cond_init(&ra_cond, NULL) == 0);
+  dirty_bytes = 0;
+  page_bytes = 0;
+  next_gen = 0;
+  next_fh = 0;
+  memset(&stats, 0, sizeof(stats));
+  this->wb_expire = wb_expire;
+  stopping = false;
+  if (wb_expire > 0)
+    flusher_th = method_thread(this, false, &extent_client::flusher);
+  ra_th = method_thread(this, false, &extent_client::readahead);
 }
 
+extent_client::~extent_client()
+{
+  {
+    ScopedLock ml(&m);
+    stopping = true;
+    VERIFY(pthread_cond_signal(&flusher_cond) == 0);
+    VERIFY(pthread_cond_signal(&ra_cond) == 0);
+  }
+  if (wb_expire > 0)
+    VERIFY(pthread_join(flusher_th, NULL) == 0);
+  VERIFY(pthread_join(ra_th, NULL) == 0);
+  {
+    ScopedLock ml(&m);
+    while (!wcache.empty()) {
+      extent_protocol::extentid_t eid = wcache.begin()->first;
+      if (flush_locked(eid) != extent_protocol::OK)
+        discard(eid);
+    }
+  }
+  VERIFY(pthread_cond_destroy(&flusher_cond) == 0);
+  VERIFY(pthread_cond_destroy(&flush_cond) == 0);
+  VERIFY(pthread_cond_destroy(&ra_cond) == 0);
+  VERIFY(pthread_mutex_destroy(&m) == 0);
+  delete es;
+}
+
+// Once a second, write out the extents that have been dirty for
+// wb_expire seconds.
+void
+extent_client::flusher()
+{
+  ScopedLock ml(&m);
+  std::map<extent_protocol::extentid_t, dirty_extent>::iterator it;
+  std::vector<extent_protocol::extentid_t> expired;
+  struct timeval now;
+  struct timespec next;
+  size_t i;
+
+  while (!stopping) {
+    gettimeofday(&now, NULL);
+    next.tv_sec = now.tv_sec + 1;
+    next.tv_nsec = now.tv_usec * 1000;
+    pthread_cond_timedwait(&flusher_cond, &m, &next);
+
+    expired.clear();
+    for (it = wcache.begin(); it != wcache.end(); ++it) {
+      if (time(NULL) - it->second.since >= wb_expire)
+        expired.push_back(it->first);
+    }
+    for (i = 0; i < expired.size(); ++i) {
+      if (flush_locked(expired[i]) != extent_protocol::OK)
+        printf("extent_client: flush %lld failed\n", expired[i]);
+    }
+  }
+}
+
+// Write out the dirty ranges of eid, after any flush of it already
+// under way. The ranges are taken out of wcache while they are
+// written, so new writes can go on; the ones that fail are put back
+// under whatever was written meanwhile.
 extent_protocol::status
-extent_client::create(uint32_t type, extent_protocol::extentid_t &id)
+extent_client::flush_locked(extent_protocol::extentid_t eid)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  ret = es->create(type, id);
+  std::map<extent_protocol::extentid_t, dirty_extent>::iterator it;
+  std::map<unsigned int, std::string>::iterator r;
+  extent_protocol::attr a;
+  dirty_extent d;
+  bool wrote = false;
+
+  while (flushing.count(eid))
+    VERIFY(pthread_cond_wait(&flush_cond, &m) == 0);
+  it = wcache.find(eid);
+  if (it == wcache.end())
+    return ret;
+  d = it->second;
+  wcache.erase(it);
+  for (r = d.ranges.begin(); r != d.ranges.end(); ++r)
+    dirty_bytes -= r->second.size();
+  flushing.insert(eid);
+
+  VERIFY(pthread_mutex_unlock(&m) == 0);
+  while (!d.ranges.empty()) {
+    r = d.ranges.begin();
+    ret = es->write_range(eid, r->first, d.mtime, r->second, a);
+    if (ret != extent_protocol::OK)
+      break;
+    wrote = true;
+    d.ranges.erase(r);
+  }
+  VERIFY(pthread_mutex_lock(&m) == 0);
+
+  if (wrote) {
+    acache_update(eid, a);
+    page_drop(eid);
+  }
+  if (!d.ranges.empty()) {
+    it = wcache.find(eid);
+    if (it != wcache.end()) {
+      for (r = it->second.ranges.begin(); r != it->second.ranges.end(); ++r) {
+        dirty_bytes -= r->second.size();
+        merge_range(d, r->first, r->second);
+      }
+      if (it->second.end > d.end)
+        d.end = it->second.end;
+      d.mtime = it->second.mtime;
+    }
+    for (r = d.ranges.begin(); r != d.ranges.end(); ++r)
+      dirty_bytes += r->second.size();
+    wcache[eid] = d;
+  }
+  flushing.erase(eid);
+  VERIFY(pthread_cond_broadcast(&flush_cond) == 0);
+  return ret;
+}
+
+// Merge buf, written at off, into the dirty ranges of d, over what is
+// there. Return how many more bytes d holds.
+size_t
+extent_client::merge_range(dirty_extent &d, unsigned int off, std::string buf)
+{
+  std::map<unsigned int, std::string>::iterator r;
+  unsigned int lo = off, hi = off + buf.size();
+  size_t removed = 0;
+
+  // merge with the ranges buf overlaps or touches
+  r = d.ranges.upper_bound(lo);
+  if (r != d.ranges.begin()) {
+    --r;
+    if (r->first + r->second.size() < lo)
+      ++r;
+  }
+  while (r != d.ranges.end() && r->first <= hi) {
+    unsigned int rlo = r->first, rhi = rlo + r->second.size();
+    if (rlo < lo) {
+      buf.insert(0, r->second, 0, lo - rlo);
+      lo = rlo;
+    }
+    if (rhi > hi)
+      buf.append(r->second, hi - rlo, rhi - hi);
+    removed += r->second.size();
+    d.ranges.erase(r++);
+  }
+  d.ranges[lo].swap(buf);
+  return d.ranges[lo].size() - removed;
+}
+
+// Drop the dirty ranges of eid unwritten.
+void
+extent_client::discard(extent_protocol::extentid_t eid)
+{
+  std::map<extent_protocol::extentid_t, dirty_extent>::iterator it;
+  std::map<unsigned int, std::string>::iterator r;
+
+  it = wcache.find(eid);
+  if (it == wcache.end())
+    return;
+  for (r = it->second.ranges.begin(); r != it->second.ranges.end(); ++r)
+    dirty_bytes -= r->second.size();
+  wcache.erase(it);
+}
+
+// Read the queued readahead into the page cache. Requests for
+// extents whose pages were dropped since are stale and skipped, as
+// are pages that are already cached.
+void
+extent_client::readahead()
+{
+  ScopedLock ml(&m);
+  std::map<extent_protocol::extentid_t, cached_extent>::iterator c;
+  std::map<unsigned int, page_entry>::iterator p;
+  extent_protocol::status ret;
+  unsigned long long gen;
+  std::string buf;
+
+  while (!stopping) {
+    if (ra_queue.empty()) {
+      VERIFY(pthread_cond_wait(&ra_cond, &m) == 0);
+      continue;
+    }
+    ra_request r = ra_queue.front();
+    ra_queue.pop_front();
+
+    c = pcache.find(r.eid);
+    if (c == pcache.end() || wcache.count(r.eid))
+      continue;
+    while (r.len > 0 && (p = c->second.pages.find(r.off / RA_PAGE)) !=
+           c->second.pages.end()) {
+      if (p->second.data.size() < RA_PAGE) {
+        r.len = 0;
+        break;
+      }
+      r.off += RA_PAGE;
+      r.len -= RA_PAGE;
+    }
+    if (r.len == 0)
+      continue;
+    gen = c->second.gen;
+
+    VERIFY(pthread_mutex_unlock(&m) == 0);
+    ret = es->read_range(r.eid, r.off, r.len, buf);
+    VERIFY(pthread_mutex_lock(&m) == 0);
+    if (ret != extent_protocol::OK)
+      continue;
+    count(r.fh, 0, 0, (buf.size() + RA_PAGE - 1) / RA_PAGE);
+    page_fill(r.eid, gen, r.off, r.len, buf);
+  }
+}
+
+// Cache buf, read from off (a page boundary) for len bytes, in pages,
+// unless the pages of eid were dropped since generation gen. A short
+// read ends in a short page, which marks the end of the extent.
+void
+extent_client::page_fill(extent_protocol::extentid_t eid,
+                         unsigned long long gen, unsigned int off,
+                         unsigned int len, const std::string &buf)
+{
+  std::map<extent_protocol::extentid_t, cached_extent>::iterator c;
+  unsigned int pos;
+
+  c = pcache.find(eid);
+  if (c == pcache.end() || c->second.gen != gen)
+    return;
+  for (pos = 0; pos < len; pos += RA_PAGE) {
+    unsigned int pn = (off + pos) / RA_PAGE;
+    std::string data;
+    if (pos < buf.size())
+      data = buf.substr(pos, RA_PAGE);
+    bool eof = data.size() < RA_PAGE;
+    if (!c->second.pages.count(pn)) {
+      page_entry &e = c->second.pages[pn];
+      e.data.swap(data);
+      page_lru.push_front(std::make_pair(eid, pn));
+      e.lru = page_lru.begin();
+      page_bytes += e.data.size();
+    }
+    if (eof)
+      break;
+  }
+
+  while (page_bytes > PAGE_BUDGET) {
+    std::pair<extent_protocol::extentid_t, unsigned int> k = page_lru.back();
+    page_lru.pop_back();
+    std::map<unsigned int, page_entry> &pages = pcache[k.first].pages;
+    page_bytes -= pages[k.second].data.size();
+    pages.erase(k.second);
+  }
+}
+
+// Add to the page cache counters of fh, if it is still open, and to
+// the totals.
+void
+extent_client::count(unsigned long long fh, unsigned long long hits,
+                     unsigned long long misses, unsigned long long readahead)
+{
+  std::map<unsigned long long, ra_file>::iterator it;
+
+  stats.hits += hits;
+  stats.misses += misses;
+  stats.readahead += readahead;
+  it = ra_files.find(fh);
+  if (it == ra_files.end())
+    return;
+  it->second.stats.hits += hits;
+  it->second.stats.misses += misses;
+  it->second.stats.readahead += readahead;
+}
+
+// Drop the cached pages of eid.
+void
+extent_client::page_drop(extent_protocol::extentid_t eid)
+{
+  std::map<extent_protocol::extentid_t, cached_extent>::iterator c;
+  std::map<unsigned int, page_entry>::iterator p;
+
+  c = pcache.find(eid);
+  if (c == pcache.end())
+    return;
+  for (p = c->second.pages.begin(); p != c->second.pages.end(); ++p) {
+    page_bytes -= p->second.data.size();
+    page_lru.erase(p->second.lru);
+  }
+  pcache.erase(c);
+}
+
+// Get the attributes of eid, and drop its cached pages if it has
+// changed on the server since they were read.
+extent_protocol::status
+extent_client::page_check(extent_protocol::extentid_t eid,
+                          extent_protocol::attr &a)
+{
+  extent_protocol::status ret;
+  std::map<extent_protocol::extentid_t, cached_extent>::iterator c;
+
+  if ((ret = getattr_locked(eid, a)) != extent_protocol::OK)
+    return ret;
+  c = pcache.find(eid);
+  if (c != pcache.end() && c->second.version != a.version)
+    page_drop(eid);
+  c = pcache.find(eid);
+  if (c == pcache.end()) {
+    c = pcache.insert(std::make_pair(eid, cached_extent())).first;
+    c->second.gen = ++next_gen;
+  }
+  c->second.version = a.version;
+  return ret;
+}
+
+// Cache a for eid, unless what is cached is a newer version.
+void
+extent_client::acache_update(extent_protocol::extentid_t eid,
+                             const extent_protocol::attr &a)
+{
+  std::map<extent_protocol::extentid_t, acache_entry>::iterator it;
+
+  it = acache.find(eid);
+  if (it != acache.end() && it->second.a.version > a.version)
+    return;
+  acache[eid].a = a;
+  acache[eid].fetched = time(NULL);
+}
+
+extent_protocol::status
+extent_client::create(uint32_t type, extent_protocol::extentid_t &id,
+                      uint32_t flags)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->create(type, flags, id);
+  if (ret == extent_protocol::OK) {
+    ScopedLock ml(&m);
+    acache.erase(id);
+    discard(id);
+    page_drop(id);
+  }
   return ret;
 }
 
@@ -24,25 +371,163 @@ extent_protocol::status
 extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
+  {
+    ScopedLock ml(&m);
+    if ((ret = flush_locked(eid)) != extent_protocol::OK)
+      return ret;
+  }
   ret = es->get(eid, buf);
   return ret;
 }
 
 extent_protocol::status
-extent_client::getattr(extent_protocol::extentid_t eid, 
-		       extent_protocol::attr &attr)
+extent_client::read_range(extent_protocol::extentid_t eid, unsigned int off,
+                          unsigned int len, std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  {
+    ScopedLock ml(&m);
+    if ((ret = flush_locked(eid)) != extent_protocol::OK)
+      return ret;
+  }
+  ret = es->read_range(eid, off, len, buf);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::write_range(extent_protocol::extentid_t eid, unsigned int off,
+                           std::string buf)
 {
+  ScopedLock ml(&m);
   extent_protocol::status ret = extent_protocol::OK;
+  extent_protocol::attr a;
+
+  page_drop(eid);
+  if (wb_expire == 0 || buf.empty()) {
+    if ((ret = flush_locked(eid)) != extent_protocol::OK)
+      return ret;
+    VERIFY(pthread_mutex_unlock(&m) == 0);
+    ret = es->write_range(eid, off, 0, buf, a);
+    VERIFY(pthread_mutex_lock(&m) == 0);
+    if (ret == extent_protocol::OK)
+      acache_update(eid, a);
+    page_drop(eid);
+    return ret;
+  }
+
+  dirty_extent &d = wcache[eid];
+  if (d.ranges.empty()) {
+    d.end = 0;
+    d.since = time(NULL);
+  }
+  d.mtime = time(NULL);
+  if (off + buf.size() > d.end)
+    d.end = off + buf.size();
+  dirty_bytes += merge_range(d, off, buf);
+
+  // over budget: write out the extents dirty longest
+  while (dirty_bytes > WCACHE_BUDGET && !wcache.empty()) {
+    std::map<extent_protocol::extentid_t, dirty_extent>::iterator it, old;
+    for (old = it = wcache.begin(); it != wcache.end(); ++it)
+      if (it->second.since < old->second.since)
+        old = it;
+    // this write is in the cache already; a failed flush keeps its
+    // ranges dirty, so fsync or release of that extent reports it
+    if (flush_locked(old->first) != extent_protocol::OK)
+      break;
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client::truncate(extent_protocol::extentid_t eid, unsigned int size)
+{
+  ScopedLock ml(&m);
+  extent_protocol::status ret = extent_protocol::OK;
+  extent_protocol::attr a;
+  if ((ret = flush_locked(eid)) != extent_protocol::OK)
+    return ret;
+  page_drop(eid);
+  VERIFY(pthread_mutex_unlock(&m) == 0);
+  ret = es->truncate(eid, size, a);
+  VERIFY(pthread_mutex_lock(&m) == 0);
+  if (ret == extent_protocol::OK)
+    acache_update(eid, a);
+  page_drop(eid);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::seek(extent_protocol::extentid_t eid, unsigned int off,
+                    int whence, unsigned int &pos)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  {
+    ScopedLock ml(&m);
+    if ((ret = flush_locked(eid)) != extent_protocol::OK)
+      return ret;
+  }
+  ret = es->seek(eid, off, whence, pos);
+  return ret;
+}
+
+// The attributes of eid as the server last reported them.
+extent_protocol::status
+extent_client::getattr_locked(extent_protocol::extentid_t eid,
+                              extent_protocol::attr &attr)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  std::map<extent_protocol::extentid_t, acache_entry>::iterator it;
+
+  it = acache.find(eid);
+  if (it != acache.end() && time(NULL) - it->second.fetched < ACACHE_TIMEOUT) {
+    attr = it->second.a;
+    return ret;
+  }
+  VERIFY(pthread_mutex_unlock(&m) == 0);
   ret = es->getattr(eid, attr);
+  VERIFY(pthread_mutex_lock(&m) == 0);
+  if (ret == extent_protocol::OK)
+    acache_update(eid, attr);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::getattr(extent_protocol::extentid_t eid,
+		       extent_protocol::attr &attr)
+{
+  ScopedLock ml(&m);
+  extent_protocol::status ret = extent_protocol::OK;
+  std::map<extent_protocol::extentid_t, dirty_extent>::iterator d;
+
+  ret = getattr_locked(eid, attr);
+
+  // as it will be once the dirty ranges are written
+  d = wcache.find(eid);
+  if (ret == extent_protocol::OK && d != wcache.end()) {
+    if (d->second.end > attr.size)
+      attr.size = d->second.end;
+    attr.mtime = attr.ctime = d->second.mtime;
+  }
   return ret;
 }
 
 extent_protocol::status
 extent_client::put(extent_protocol::extentid_t eid, std::string buf)
 {
+  ScopedLock ml(&m);
   extent_protocol::status ret = extent_protocol::OK;
-  int r;
-  ret = es->put(eid, buf, r);
+  extent_protocol::attr a;
+  while (flushing.count(eid))
+    VERIFY(pthread_cond_wait(&flush_cond, &m) == 0);
+  discard(eid);
+  page_drop(eid);
+  VERIFY(pthread_mutex_unlock(&m) == 0);
+  ret = es->put(eid, buf, a);
+  VERIFY(pthread_mutex_lock(&m) == 0);
+  if (ret == extent_protocol::OK)
+    acache_update(eid, a);
+  page_drop(eid);
   return ret;
 }
 
@@ -51,8 +536,200 @@ extent_client::remove(extent_protocol::extentid_t eid)
 {
   extent_protocol::status ret = extent_protocol::OK;
   int r;
+  {
+    ScopedLock ml(&m);
+    while (flushing.count(eid))
+      VERIFY(pthread_cond_wait(&flush_cond, &m) == 0);
+    discard(eid);
+    page_drop(eid);
+  }
   ret = es->remove(eid, r);
+  ScopedLock ml(&m);
+  acache.erase(eid);
+  page_drop(eid);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::open(extent_protocol::extentid_t eid, unsigned long long &fh)
+{
+  ScopedLock ml(&m);
+  fh = ++next_fh;
+  ra_file &f = ra_files[fh];
+  f.eid = eid;
+  f.next = 0;
+  f.window = 0;
+  f.ra_end = 0;
+  memset(&f.stats, 0, sizeof(f.stats));
+  return extent_protocol::OK;
+}
+
+// Append to buf the part of data, which starts at base, that lies
+// in [off, off + len).
+static void
+append_overlap(std::string &buf, unsigned int base, const std::string &data,
+               unsigned int off, unsigned int len)
+{
+  unsigned int lo = base > off ? base : off;
+  unsigned int hi = base + data.size();
+  if (hi > off + len)
+    hi = off + len;
+  if (lo < hi)
+    buf.append(data, lo - base, hi - lo);
+}
+
+// Read through the page cache on behalf of open file fh, and read
+// ahead if the reads on it are sequential.
+extent_protocol::status
+extent_client::read(unsigned long long fh, unsigned int off,
+                    unsigned int len, std::string &buf)
+{
+  ScopedLock ml(&m);
+  extent_protocol::status ret = extent_protocol::OK;
+  std::map<unsigned long long, ra_file>::iterator it;
+  std::map<extent_protocol::extentid_t, cached_extent>::iterator c;
+  std::map<unsigned int, page_entry>::iterator p;
+  extent_protocol::extentid_t eid;
+  extent_protocol::attr a;
+  unsigned int pn, last, end = off + len;
+  unsigned long long hits = 0, misses = 0, ahead = 0;
+
+  buf.clear();
+  it = ra_files.find(fh);
+  if (it == ra_files.end())
+    return extent_protocol::NOENT;
+  eid = it->second.eid;
+  if (len == 0)
+    return ret;
+  if ((ret = flush_locked(eid)) != extent_protocol::OK)
+    return ret;
+  if ((ret = page_check(eid, a)) != extent_protocol::OK)
+    return ret;
+
+  c = pcache.find(eid);
+  last = (end - 1) / RA_PAGE;
+  for (pn = off / RA_PAGE; pn <= last; pn++) {
+    p = c->second.pages.find(pn);
+    if (p == c->second.pages.end()) {
+      std::string data;
+      unsigned int n = (last + 1 - pn) * RA_PAGE;
+      unsigned long long gen = c->second.gen;
+      // readahead that has not started yet is done here instead
+      std::list<ra_request>::iterator q;
+      for (q = ra_queue.begin(); q != ra_queue.end(); ) {
+        if (q->eid == eid && q->off <= pn * RA_PAGE &&
+            q->off + q->len > pn * RA_PAGE) {
+          if (q->off + q->len > pn * RA_PAGE + n)
+            n = q->off + q->len - pn * RA_PAGE;
+          q = ra_queue.erase(q);
+        } else {
+          ++q;
+        }
+      }
+      VERIFY(pthread_mutex_unlock(&m) == 0);
+      ret = es->read_range(eid, pn * RA_PAGE, n, data);
+      VERIFY(pthread_mutex_lock(&m) == 0);
+      if (ret != extent_protocol::OK)
+        return ret;
+      misses += last + 1 - pn;
+      if (data.size() > (last + 1 - pn) * RA_PAGE)
+        ahead += (data.size() - (last + 1 - pn) * RA_PAGE +
+                  RA_PAGE - 1) / RA_PAGE;
+      append_overlap(buf, pn * RA_PAGE, data, off, len);
+      page_fill(eid, gen, pn * RA_PAGE, n, data);
+      break;
+    }
+    hits++;
+    page_lru.splice(page_lru.begin(), page_lru, p->second.lru);
+    append_overlap(buf, pn * RA_PAGE, p->second.data, off, len);
+    if (p->second.data.size() < RA_PAGE)
+      break;
+  }
+
+  count(fh, hits, misses, ahead);
+
+  // the file may have been closed meanwhile
+  it = ra_files.find(fh);
+  if (it == ra_files.end())
+    return ret;
+  ra_file &f = it->second;
+  if (off != f.next) {
+    f.window = 0;
+  } else if (f.window == 0 || end + f.window / 2 > f.ra_end) {
+    f.window = f.window == 0 ? RA_MIN : f.window * 2;
+    if (f.window > RA_MAX)
+      f.window = RA_MAX;
+    if (f.ra_end < end)
+      f.ra_end = end;
+    if (f.ra_end < a.size && f.ra_end < end + f.window) {
+      ra_request r;
+      r.fh = fh;
+      r.eid = eid;
+      r.off = f.ra_end / RA_PAGE * RA_PAGE;
+      r.len = (end + f.window - r.off + RA_PAGE - 1) / RA_PAGE * RA_PAGE;
+      ra_queue.push_back(r);
+      VERIFY(pthread_cond_signal(&ra_cond) == 0);
+    }
+    f.ra_end = end + f.window;
+  }
+  f.next = end;
   return ret;
 }
 
+extent_protocol::status
+extent_client::close(unsigned long long fh)
+{
+  ScopedLock ml(&m);
+  ra_files.erase(fh);
+  return extent_protocol::OK;
+}
+
+// Log the page cache counters, in total and for each open handle.
+void
+extent_client::print_stats()
+{
+  ScopedLock ml(&m);
+  std::map<unsigned long long, ra_file>::iterator it;
+
+  printf("extent_client: pages: %llu hits %llu misses %llu readahead\n",
+         stats.hits, stats.misses, stats.readahead);
+  for (it = ra_files.begin(); it != ra_files.end(); ++it) {
+    const ra_file &f = it->second;
+    printf("extent_client: handle %llu (extent %lld): %llu hits %llu misses "
+           "%llu readahead, window %u\n", it->first, f.eid, f.stats.hits,
+           f.stats.misses, f.stats.readahead, f.window);
+  }
+  es->print_contention();
+}
 
+extent_protocol::status
+extent_client::flush(extent_protocol::extentid_t eid)
+{
+  ScopedLock ml(&m);
+  return flush_locked(eid);
+}
+
+extent_protocol::status
+extent_client::sync(extent_protocol::extentid_t eid)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  {
+    ScopedLock ml(&m);
+    while (!wcache.empty())
+      if ((ret = flush_locked(wcache.begin()->first)) != extent_protocol::OK)
+        return ret;
+    while (!flushing.empty())
+      VERIFY(pthread_cond_wait(&flush_cond, &m) == 0);
+  }
+  ret = es->sync(eid, r);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::statfs(extent_protocol::fsstat &s)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->statfs(1, s);
+  return ret;
+}
@@ -4,23 +4,168 @@
 #define extent_client_h
 
 #include <string>
+#include <map>
+#include <list>
+#include <set>
+#include <time.h>
+#include <pthread.h>
 #include "extent_protocol.h"
 #include "extent_server.h"
 
+// Attributes are cached for ACACHE_TIMEOUT seconds, so changes made
+// by other clients show up within that; this client's own changes
+// replace them at once with the attributes the server returns.
+// Reads do not refresh the cached atime.
+#define ACACHE_TIMEOUT 1
+
+// Writes are held back as dirty byte ranges per extent, adjacent and
+// overlapping ones merged, and written out one range per call when
+// the extent is read, truncated or synced, when flush() is called,
+// once it has been dirty for wb_expire seconds, or oldest first when
+// more than WCACHE_BUDGET bytes are dirty. A wb_expire of 0 writes
+// through. The ranges carry the time of the last write to the server
+// as the mtime, which getattr reports while they are dirty. A range
+// that fails to write stays dirty, and the error is returned by the
+// next flush or sync of its extent rather than to the writer.
+#define WCACHE_EXPIRE  5
+#define WCACHE_BUDGET  (4 << 20)
+
+// Reads through an open file handle go through a page cache of up to
+// PAGE_BUDGET bytes in RA_PAGE pages, dropped on any change to the
+// extent made here and when its version changes on the server. A read
+// that starts where the last one on the handle ended is sequential
+// and reads ahead a window past it, asynchronously, that starts at
+// RA_MIN and doubles up to RA_MAX each time the reader catches up
+// with it; any other read closes the window. Page hits, misses and
+// readahead are counted per handle and in total; print_stats() logs
+// them, along with the server's lock contention.
+#define RA_PAGE      4096
+#define RA_MIN       (4 * RA_PAGE)
+#define RA_MAX       (128 * RA_PAGE)
+#define PAGE_BUDGET  (16 << 20)
+
+// m protects the caches and is not held across calls to the server,
+// so calls from several threads reach it together. Functions named
+// _locked are called with m held and may drop it while they wait for
+// the server or for a flush in progress.
+
 class extent_client {
+ public:
+  struct ra_counters {
+    unsigned long long hits;       // pages found in the cache
+    unsigned long long misses;     // pages read on demand
+    unsigned long long readahead;  // pages read ahead
+  };
+
  private:
   extent_server *es;
+  pthread_mutex_t m;
+
+  struct dirty_extent {
+    std::map<unsigned int, std::string> ranges;  // by offset, disjoint
+    unsigned int end;  // past the last dirty byte
+    time_t since;      // when it became dirty
+    time_t mtime;      // of the last write
+  };
+  std::map<extent_protocol::extentid_t, dirty_extent> wcache;
+  std::set<extent_protocol::extentid_t> flushing;  // being written out
+  pthread_cond_t flush_cond;
+  size_t dirty_bytes;
+  int wb_expire;
+  bool stopping;
+  pthread_cond_t flusher_cond;
+  pthread_t flusher_th;
+
+  struct page_entry {
+    std::string data;  // short only at the end of the extent
+    std::list<std::pair<extent_protocol::extentid_t, unsigned int> >::iterator lru;
+  };
+  struct cached_extent {
+    unsigned long long version;
+    unsigned long long gen;  // tells a dropped and recreated entry apart
+    std::map<unsigned int, page_entry> pages;  // by page number
+  };
+  std::map<extent_protocol::extentid_t, cached_extent> pcache;
+  std::list<std::pair<extent_protocol::extentid_t, unsigned int> > page_lru;
+  size_t page_bytes;
+  unsigned long long next_gen;
+
+  struct ra_file {
+    extent_protocol::extentid_t eid;
+    unsigned int next;    // where a sequential read would start
+    unsigned int window;  // 0 when access is not sequential
+    unsigned int ra_end;  // how far readahead has been queued
+    ra_counters stats;    // of this handle
+  };
+  std::map<unsigned long long, ra_file> ra_files;
+  unsigned long long next_fh;
+  ra_counters stats;  // of all handles, closed ones included
+
+  struct ra_request {
+    unsigned long long fh;  // the handle it is read ahead for
+    extent_protocol::extentid_t eid;
+    unsigned int off, len;
+  };
+  std::list<ra_request> ra_queue;
+  pthread_cond_t ra_cond;
+  pthread_t ra_th;
+
+  void flusher();
+  void readahead();
+  void page_fill(extent_protocol::extentid_t eid, unsigned long long gen,
+                 unsigned int off, unsigned int len, const std::string &buf);
+  void page_drop(extent_protocol::extentid_t eid);
+  void count(unsigned long long fh, unsigned long long hits,
+             unsigned long long misses, unsigned long long readahead);
+  extent_protocol::status page_check(extent_protocol::extentid_t eid,
+                                     extent_protocol::attr &a);
+  extent_protocol::status getattr_locked(extent_protocol::extentid_t eid,
+                                         extent_protocol::attr &a);
+  extent_protocol::status flush_locked(extent_protocol::extentid_t eid);
+  size_t merge_range(dirty_extent &d, unsigned int off, std::string buf);
+  void discard(extent_protocol::extentid_t eid);
+
+  struct acache_entry {
+    extent_protocol::attr a;
+    time_t fetched;
+  };
+  std::map<extent_protocol::extentid_t, acache_entry> acache;
+
+  void acache_update(extent_protocol::extentid_t eid,
+                     const extent_protocol::attr &a);
 
  public:
-  extent_client();
+  extent_client(int atime_policy = extent_protocol::STRICTATIME,
+                int wb_expire = WCACHE_EXPIRE);
+  ~extent_client();
 
-  extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid);
+  extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid,
+                                 uint32_t flags = 0);
   extent_protocol::status get(extent_protocol::extentid_t eid, 
 			                        std::string &buf);
+  extent_protocol::status read_range(extent_protocol::extentid_t eid,
+                                     unsigned int off, unsigned int len,
+                                     std::string &buf);
+  extent_protocol::status write_range(extent_protocol::extentid_t eid,
+                                      unsigned int off, std::string buf);
+  extent_protocol::status truncate(extent_protocol::extentid_t eid,
+                                   unsigned int size);
+  extent_protocol::status seek(extent_protocol::extentid_t eid,
+                               unsigned int off, int whence,
+                               unsigned int &pos);
   extent_protocol::status getattr(extent_protocol::extentid_t eid, 
 				                          extent_protocol::attr &a);
   extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
+  extent_protocol::status open(extent_protocol::extentid_t eid,
+                               unsigned long long &fh);
+  extent_protocol::status read(unsigned long long fh, unsigned int off,
+                               unsigned int len, std::string &buf);
+  extent_protocol::status close(unsigned long long fh);
+  void print_stats();
+  extent_protocol::status flush(extent_protocol::extentid_t eid);
+  extent_protocol::status sync(extent_protocol::extentid_t eid);
+  extent_protocol::status statfs(extent_protocol::fsstat &s);
 };
 
 #endif 
@@ -14,7 +14,13 @@ class extent_protocol {
     put = 0x6001,
     get,
     getattr,
-    remove
+    remove,
+    sync,
+    read_range,
+    write_range,
+    truncate,
+    seek,
+    statfs
   };
 
   enum types {
@@ -22,12 +28,35 @@ class extent_protocol {
     T_FILE
   };
 
+  // flags given to create
+  enum create_flags {
+    EXTENTS = 0x1   // map the blocks by extents rather than a block map
+  };
+
+  // when reads update a file's atime
+  enum atime_policy {
+    STRICTATIME,  // on every read
+    RELATIME,     // if older than mtime/ctime or a day old
+    NOATIME,      // never
+    LAZYTIME      // on every read, but kept in memory
+  };
+
   struct attr {
     uint32_t type;
     unsigned int atime;
     unsigned int mtime;
     unsigned int ctime;
     unsigned int size;
+    unsigned long long version;  // bumped by every change to the extent
+  };
+
+  // file system totals, in blocks and inodes
+  struct fsstat {
+    uint32_t bsize;
+    uint32_t blocks;
+    uint32_t bfree;
+    uint32_t files;
+    uint32_t ffree;
   };
 };
 
@@ -39,6 +68,7 @@ operator>>(unmarshall &u, extent_protocol::attr &a)
   u >> a.mtime;
   u >> a.ctime;
   u >> a.size;
+  u >> a.version;
   return u;
 }
 
@@ -50,6 +80,29 @@ operator<<(marshall &m, extent_protocol::attr a)
   m << a.mtime;
   m << a.ctime;
   m << a.size;
+  m << a.version;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::fsstat &s)
+{
+  u >> s.bsize;
+  u >> s.blocks;
+  u >> s.bfree;
+  u >> s.files;
+  u >> s.ffree;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::fsstat s)
+{
+  m << s.bsize;
+  m << s.blocks;
+  m << s.bfree;
+  m << s.files;
+  m << s.ffree;
   return m;
 }
 
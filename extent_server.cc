@@ -8,30 +8,111 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include "slock.h"
 
-extent_server::extent_server() 
+extent_server::extent_server(int atime_policy)
 {
-  im = new inode_manager();
+  im = new inode_manager(atime_policy);
+  version_base = (unsigned long long) time(NULL) << 20;
+  next_version = version_base;
+  VERIFY(pthread_mutex_init(&versions_m, NULL) == 0);
+  memset(elocks, 0, sizeof(elocks));
+  for (int i = 0; i < ELOCK_NUM; ++i)
+    VERIFY(pthread_rwlock_init(&elocks[i].l, NULL) == 0);
 }
 
-int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
+// Take the lock of id, shared or exclusive, counting it as contended
+// if it is not free right away.
+extent_server::ScopedELock::ScopedELock(extent_server *es,
+                                         extent_protocol::extentid_t id,
+                                         bool exclusive)
+{
+  elock_shard *s = &es->elocks[id % ELOCK_NUM];
+  int r;
+
+  l_ = &s->l;
+  r = exclusive ? pthread_rwlock_trywrlock(l_) : pthread_rwlock_tryrdlock(l_);
+  if (r != 0) {
+    VERIFY(r == EBUSY);
+    __sync_fetch_and_add(&s->contended, 1);
+    __atomic_store_n(&s->hot, id, __ATOMIC_RELAXED);
+    if (exclusive)
+      VERIFY(pthread_rwlock_wrlock(l_) == 0);
+    else
+      VERIFY(pthread_rwlock_rdlock(l_) == 0);
+  }
+  __sync_fetch_and_add(&s->acquired, 1);
+}
+
+extent_server::ScopedELock::~ScopedELock()
+{
+  VERIFY(pthread_rwlock_unlock(l_) == 0);
+}
+
+// Log the shards whose lock anyone had to wait for. Called on
+// request, not on a schedule of its own.
+void
+extent_server::print_contention()
+{
+  for (int i = 0; i < ELOCK_NUM; ++i) {
+    elock_shard *s = &elocks[i];
+    unsigned long long contended = __atomic_load_n(&s->contended,
+                                                   __ATOMIC_RELAXED);
+    if (contended == 0)
+      continue;
+    printf("extent_server: shard %d: %llu of %llu waited, last %lld\n", i,
+           contended, __atomic_load_n(&s->acquired, __ATOMIC_RELAXED),
+           __atomic_load_n(&s->hot, __ATOMIC_RELAXED));
+  }
+}
+
+// Give id a new version if a change to it succeeded (r is OK), and
+// return r with the resulting attributes in a. The caller holds the
+// lock of id exclusively.
+int extent_server::changed(extent_protocol::extentid_t id, int r,
+                           extent_protocol::attr &a)
+{
+  if (r != extent_protocol::OK)
+    return r;
+  memset(&a, 0, sizeof(a));
+  im->getattr(id, a);
+  ScopedLock ml(&versions_m);
+  a.version = versions[id] = ++next_version;
+  return r;
+}
+
+extent_server::~extent_server()
+{
+  delete im;
+  for (int i = 0; i < ELOCK_NUM; ++i)
+    VERIFY(pthread_rwlock_destroy(&elocks[i].l) == 0);
+  VERIFY(pthread_mutex_destroy(&versions_m) == 0);
+}
+
+int extent_server::create(uint32_t type, uint32_t flags,
+                          extent_protocol::extentid_t &id)
 {
   // alloc a new inode and return inum
   printf("extent_server: create inode\n");
-  id = im->alloc_inode(type);
+  id = im->alloc_inode(type,
+                       (flags & extent_protocol::EXTENTS) ? I_EXTENTS : 0);
+  ScopedLock ml(&versions_m);
+  versions[id] = ++next_version;
 
   return extent_protocol::OK;
 }
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
+int extent_server::put(extent_protocol::extentid_t id, std::string buf,
+                       extent_protocol::attr &a)
 {
   id &= 0x7fffffff;
-  
+  ScopedELock l(this, id, true);
+
   const char * cbuf = buf.c_str();
   int size = buf.size();
-  im->write_file(id, cbuf, size);
-  
-  return extent_protocol::OK;
+
+  return changed(id, im->write_file(id, cbuf, size), a);
 }
 
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
@@ -39,6 +120,7 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
   printf("extent_server: get %lld\n", id);
 
   id &= 0x7fffffff;
+  ScopedELock l(this, id, false);
 
   int size = 0;
   char *cbuf = NULL;
@@ -54,15 +136,78 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
   return extent_protocol::OK;
 }
 
+int extent_server::read_range(extent_protocol::extentid_t id,
+                              unsigned int off, unsigned int len,
+                              std::string &buf)
+{
+  printf("extent_server: read_range %lld %u %u\n", id, off, len);
+
+  id &= 0x7fffffff;
+  ScopedELock l(this, id, false);
+
+  int size = 0;
+  char *cbuf = NULL;
+
+  im->read_range(id, off, len, &cbuf, &size);
+  if (size == 0)
+    buf = "";
+  else {
+    buf.assign(cbuf, size);
+    free(cbuf);
+  }
+
+  return extent_protocol::OK;
+}
+
+int extent_server::write_range(extent_protocol::extentid_t id,
+                               unsigned int off, unsigned int mtime,
+                               std::string buf, extent_protocol::attr &a)
+{
+  printf("extent_server: write_range %lld %u %zu\n", id, off, buf.size());
+
+  id &= 0x7fffffff;
+  ScopedELock l(this, id, true);
+
+  return changed(id, im->write_range(id, off, buf.data(), buf.size(), mtime),
+                 a);
+}
+
+int extent_server::truncate(extent_protocol::extentid_t id,
+                            unsigned int size, extent_protocol::attr &a)
+{
+  printf("extent_server: truncate %lld %u\n", id, size);
+
+  id &= 0x7fffffff;
+  ScopedELock l(this, id, true);
+
+  return changed(id, im->truncate(id, size), a);
+}
+
+int extent_server::seek(extent_protocol::extentid_t id, unsigned int off,
+                        int whence, unsigned int &pos)
+{
+  printf("extent_server: seek %lld %u %d\n", id, off, whence);
+
+  id &= 0x7fffffff;
+  ScopedELock l(this, id, false);
+
+  return im->seek(id, off, whence, pos);
+}
+
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
   printf("extent_server: getattr %lld\n", id);
 
   id &= 0x7fffffff;
-  
+  ScopedELock l(this, id, false);
+
   extent_protocol::attr attr;
   memset(&attr, 0, sizeof(attr));
   im->getattr(id, attr);
+  {
+    ScopedLock ml(&versions_m);
+    attr.version = versions.count(id) ? versions[id] : version_base;
+  }
   a = attr;
 
   return extent_protocol::OK;
@@ -73,8 +218,30 @@ int extent_server::remove(extent_protocol::extentid_t id, int &)
   printf("extent_server: write %lld\n", id);
 
   id &= 0x7fffffff;
+  ScopedELock l(this, id, true);
   im->remove_file(id);
+  ScopedLock ml(&versions_m);
+  versions.erase(id);
  
   return extent_protocol::OK;
 }
 
+int extent_server::sync(extent_protocol::extentid_t id, int &)
+{
+  printf("extent_server: sync %lld\n", id);
+
+  im->sync();
+
+  return extent_protocol::OK;
+}
+
+int extent_server::statfs(extent_protocol::extentid_t id,
+                          extent_protocol::fsstat &s)
+{
+  printf("extent_server: statfs\n");
+
+  im->statfs(s);
+
+  return extent_protocol::OK;
+}
+
@@ -5,9 +5,27 @@
 
 #include <string>
 #include <map>
+#include <pthread.h>
 #include "extent_protocol.h"
 #include "inode_manager.h"
 
+// Calls on one extent that change it exclude all other calls on it;
+// calls that only read it run together. The locks are hashed on the
+// extent id into ELOCK_NUM shards, each on a cache line of its own so
+// that threads working on different shards do not contend for one.
+// A shard counts the acquisitions that had to wait, and remembers the
+// last extent that did; print_contention() logs the shards that saw
+// any.
+#define ELOCK_NUM 64
+#define CACHE_LINE 64
+
+struct elock_shard {
+  pthread_rwlock_t l;
+  unsigned long long acquired;
+  unsigned long long contended;
+  extent_protocol::extentid_t hot;  // last extent that waited
+} __attribute__((aligned(CACHE_LINE)));
+
 class extent_server {
  protected:
 #if 0
@@ -18,15 +36,48 @@ class extent_server {
   std::map <extent_protocol::extentid_t, extent_t> extents;
 #endif
   inode_manager *im;
+  elock_shard elocks[ELOCK_NUM];
+
+  // Holds the lock of an extent for the rest of the scope.
+  struct ScopedELock {
+    pthread_rwlock_t *l_;
+    ScopedELock(extent_server *es, extent_protocol::extentid_t id,
+                bool exclusive);
+    ~ScopedELock();
+  };
+
+  // Change counters: every change to an extent gives it a new
+  // version, which getattr and the calls that change it report.
+  // Extents not changed since the server started share version_base,
+  // which is taken from the clock so versions do not repeat across
+  // restarts.
+  std::map<extent_protocol::extentid_t, unsigned long long> versions;
+  unsigned long long version_base, next_version;
+  pthread_mutex_t versions_m;
+
+  int changed(extent_protocol::extentid_t id, int r, extent_protocol::attr &);
 
  public:
-  extent_server();
+  extent_server(int atime_policy = extent_protocol::STRICTATIME);
+  ~extent_server();
 
-  int create(uint32_t type, extent_protocol::extentid_t &id);
-  int put(extent_protocol::extentid_t id, std::string, int &);
+  int create(uint32_t type, uint32_t flags, extent_protocol::extentid_t &id);
+  int put(extent_protocol::extentid_t id, std::string,
+          extent_protocol::attr &);
   int get(extent_protocol::extentid_t id, std::string &);
+  int read_range(extent_protocol::extentid_t id, unsigned int off,
+                 unsigned int len, std::string &);
+  int write_range(extent_protocol::extentid_t id, unsigned int off,
+                  unsigned int mtime, std::string, extent_protocol::attr &);
+  int truncate(extent_protocol::extentid_t id, unsigned int size,
+               extent_protocol::attr &);
+  int seek(extent_protocol::extentid_t id, unsigned int off, int whence,
+           unsigned int &pos);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
   int remove(extent_protocol::extentid_t id, int &);
+  int sync(extent_protocol::extentid_t id, int &);
+  int statfs(extent_protocol::extentid_t id, extent_protocol::fsstat &);
+  void print_contention();
 };
 
 #endif 
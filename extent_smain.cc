@@ -30,6 +30,12 @@ main(int argc, char *argv[])
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.reg(extent_protocol::sync, &ls, &extent_server::sync);
+  server.reg(extent_protocol::read_range, &ls, &extent_server::read_range);
+  server.reg(extent_protocol::write_range, &ls, &extent_server::write_range);
+  server.reg(extent_protocol::truncate, &ls, &extent_server::truncate);
+  server.reg(extent_protocol::seek, &ls, &extent_server::seek);
+  server.reg(extent_protocol::statfs, &ls, &extent_server::statfs);
 
   while(1)
     sleep(1000);
@@ -15,12 +15,89 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <signal.h>
+#include <vector>
+#include <list>
+#include <string>
 #include "lang/verify.h"
 #include "chfs_client.h"
 
 int myid;
 chfs_client *chfs;
 
+// How long the kernel may cache names, attributes and names known not
+// to exist, in seconds; set by the entry_timeout, attr_timeout and
+// negative_timeout mount options. 0, the default, makes it ask chfs
+// every time; with caching on, a change may not be seen until its
+// queued invalidation has been sent.
+double entry_timeout = 0.0;
+double attr_timeout = 0.0;
+double negative_timeout = 0.0;
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 8)
+//
+// Changes made through chfs are pushed to the kernel's caches with
+// notify_inval calls. They may not be made from a handler for the
+// same inode, which the kernel may hold locked until the reply, so
+// handlers queue them for fuseserver_invalidator to send.
+//
+struct inval {
+    fuse_ino_t ino;
+    std::string name;  // the entry to drop; empty for the inode itself
+};
+
+static std::list<inval> inval_queue;
+static pthread_mutex_t inval_m = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+static bool inval_stopping;
+static struct fuse_chan *inval_ch;
+
+static void
+inval_later(fuse_ino_t ino, const char *name)
+{
+    if (entry_timeout == 0 && attr_timeout == 0 && negative_timeout == 0)
+        return;
+    inval i;
+    i.ino = ino;
+    if (name != NULL)
+        i.name = name;
+    VERIFY(pthread_mutex_lock(&inval_m) == 0);
+    inval_queue.push_back(i);
+    VERIFY(pthread_cond_signal(&inval_cond) == 0);
+    VERIFY(pthread_mutex_unlock(&inval_m) == 0);
+}
+
+static void *
+fuseserver_invalidator(void *)
+{
+    VERIFY(pthread_mutex_lock(&inval_m) == 0);
+    while (!inval_stopping) {
+        if (inval_queue.empty()) {
+            VERIFY(pthread_cond_wait(&inval_cond, &inval_m) == 0);
+            continue;
+        }
+        inval i = inval_queue.front();
+        inval_queue.pop_front();
+        VERIFY(pthread_mutex_unlock(&inval_m) == 0);
+        if (i.name.empty())
+            fuse_lowlevel_notify_inval_inode(inval_ch, i.ino, -1, 0);
+        else
+            fuse_lowlevel_notify_inval_entry(inval_ch, i.ino,
+                    i.name.c_str(), i.name.size());
+        VERIFY(pthread_mutex_lock(&inval_m) == 0);
+    }
+    VERIFY(pthread_mutex_unlock(&inval_m) == 0);
+    return NULL;
+}
+#else
+static void
+inval_later(fuse_ino_t ino, const char *name)
+{
+}
+#endif
+
 int id() { 
     return myid;
 }
@@ -101,7 +178,7 @@ fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
         fuse_reply_err(req, ENOENT);
         return;
     }
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, attr_timeout);
 }
 
 //
@@ -139,7 +216,7 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
     }
 
     getattr(inum, st);
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, attr_timeout);
 #else
     fuse_reply_err(req, ENOSYS);
 #endif
@@ -171,7 +248,7 @@ fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
     chfs_client::status ret;
     std::string sbuf;
 
-    ret = chfs->read(inum, size, off, sbuf);
+    ret = chfs->read(inum, size, off, sbuf, fi ? fi->fh : 0);
     if (ret != chfs_client::OK) {
         fuse_reply_err(req, ENOENT);
         return;
@@ -246,9 +323,9 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
         mode_t mode, struct fuse_entry_param *e, int type)
 {
     int ret;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
-    e->attr_timeout = 0.0;
-    e->entry_timeout = 0.0;
+    // In chfs, generations are always set to 0
+    e->attr_timeout = attr_timeout;
+    e->entry_timeout = entry_timeout;
     e->generation = 0;
 
     chfs_client::inum inum;
@@ -258,6 +335,7 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
 		ret = chfs->mkdir(parent,name,mode,inum);
     if (ret != chfs_client::OK)
         return ret;
+    inval_later(parent, NULL);
     e->ino = inum;
     ret = getattr(inum, e->attr);
     return ret;
@@ -270,6 +348,7 @@ fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
     struct fuse_entry_param e;
     chfs_client::status ret;
     if( (ret = fuseserver_createhelper( parent, name, mode, &e, extent_protocol::T_FILE)) == chfs_client::OK ) {
+        chfs->open(e.ino, fi->fh);
         fuse_reply_create(req, &e, fi);
         printf("OK: create returns.\n");
     } else {
@@ -305,9 +384,9 @@ void
 fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     struct fuse_entry_param e;
-    // In chfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
+    // In chfs, generations are always set to 0
+    e.attr_timeout = attr_timeout;
+    e.entry_timeout = entry_timeout;
     e.generation = 0;
     bool found = false;
 
@@ -318,6 +397,11 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
         e.ino = ino;
         getattr(ino, e.attr);
         fuse_reply_entry(req, &e);
+    } else if (negative_timeout > 0) {
+        // an entry with ino 0 has the kernel remember the miss
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = negative_timeout;
+        fuse_reply_entry(req, &e);
     } else {
         fuse_reply_err(req, ENOENT);
     }
@@ -325,48 +409,27 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 }
 
 
-struct dirbuf {
-    char *p;
-    size_t size;
-};
-
-void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
-{
-    struct stat stbuf;
-    size_t oldsize = b->size;
-    b->size += fuse_dirent_size(strlen(name));
-    b->p = (char *) realloc(b->p, b->size);
-    memset(&stbuf, 0, sizeof(stbuf));
-    stbuf.st_ino = ino;
-    fuse_add_dirent(b->p + oldsize, name, &stbuf, b->size);
-}
-
-#define min(x, y) ((x) < (y) ? (x) : (y))
-
-int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
-        off_t off, size_t maxsize)
-{
-    if ((size_t)off < bufsize)
-        return fuse_reply_buf(req, buf + off, min(bufsize - off, maxsize));
-    else
-        return fuse_reply_buf(req, NULL, 0);
-}
-
-//
-// Retrieve all the file names / i-numbers pairs
-// in directory @ino. Send the reply using reply_buf_limited.
 //
-// You can ignore @size and @off (except that you must pass
-// them to reply_buf_limited).
+// Fill a reply of up to @size bytes with the entries of directory @ino
+// that come after cookie @off (0 for the first call). Each entry
+// carries its own cookie, which the kernel passes back as @off to
+// continue, so a long listing is read once rather than from the
+// start for every reply.
 //
-// Call dirbuf_add(&b, name, inum) for each entry in the directory.
+// Every entry takes at least 32 bytes, which bounds how many are
+// asked of chfs.
 //
+#define DIRENT_MIN 32
+
 void
 fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
         off_t off, struct fuse_file_info *fi)
 {
     chfs_client::inum inum = ino; // req->in.h.nodeid;
-    struct dirbuf b;
+    std::list<chfs_client::dirent> entries;
+    std::vector<char> buf(size);
+    struct stat st;
+    size_t pos = 0, n;
 
     printf("fuseserver_readdir\n");
 
@@ -375,16 +438,23 @@ fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
         return;
     }
 
-    memset(&b, 0, sizeof(b));
+    if (chfs->readdir(inum, off, size / DIRENT_MIN + 1, entries)
+            != chfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
 
-    std::list<chfs_client::dirent> entries;
-    chfs->readdir(inum, entries);
+    memset(&st, 0, sizeof(st));
     for (std::list<chfs_client::dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
-        dirbuf_add(&b, it->name.c_str(), (fuse_ino_t) it->inum);
+        st.st_ino = it->inum;
+        n = fuse_add_direntry(req, buf.data() + pos, size - pos,
+                it->name.c_str(), &st, it->cookie);
+        if (n > size - pos)
+            break;
+        pos += n;
     }
 
-    reply_buf_limited(req, b.p, b.size, off, size);
-    free(b.p);
+    fuse_reply_buf(req, buf.data(), pos);
 }
 
 
@@ -392,6 +462,10 @@ void
 fuseserver_open(fuse_req_t req, fuse_ino_t ino,
         struct fuse_file_info *fi)
 {
+    if (chfs->open(ino, fi->fh) != chfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
     fuse_reply_open(req, fi);
 }
 
@@ -437,6 +511,8 @@ fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     int r;
     if ((r = chfs->unlink(parent, name)) == chfs_client::OK) {
+        inval_later(parent, name);
+        inval_later(parent, NULL);
         fuse_reply_err(req, 0);
     } else {
         if (r == chfs_client::NOENT) {
@@ -447,23 +523,143 @@ fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
     }
 }
 
+//
+// Write the file's cached state to disk.
+//
+// Ignore @datasync and @fi.
+//
+void
+fuseserver_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+        struct fuse_file_info *fi)
+{
+    chfs_client::inum inum = ino;
+
+    if (chfs->fsync(inum) != chfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_err(req, 0);
+}
+
+//
+// Write out the file's buffered writes when its last open
+// reference is closed. The error is not seen by close(2).
+//
+void
+fuseserver_release(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    chfs_client::inum inum = ino;
+
+    if (chfs->release(inum, fi->fh) != chfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_err(req, 0);
+}
+
 void
 fuseserver_statfs(fuse_req_t req)
 {
     struct statvfs buf;
+    chfs_client::fsinfo fs;
 
     printf("statfs\n");
 
+    if (chfs->statfs(fs) != chfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
     memset(&buf, 0, sizeof(buf));
 
-    buf.f_namemax = 255;
-    buf.f_bsize = 512;
+    buf.f_namemax = CHFS_NAME_LEN;
+    buf.f_bsize = fs.bsize;
+    buf.f_frsize = fs.bsize;
+    buf.f_blocks = fs.blocks;
+    buf.f_bfree = fs.bfree;
+    buf.f_bavail = fs.bfree;
+    buf.f_files = fs.files;
+    buf.f_ffree = fs.ffree;
+    buf.f_favail = fs.ffree;
 
     fuse_reply_statfs(req, &buf);
 }
 
 struct fuse_lowlevel_ops fuseserver_oper;
 
+//
+// Mount options handled by chfs itself rather than by FUSE.
+//
+struct chfs_options {
+    int atime;
+    int writeback;  // seconds writes may be held back; 0 writes through
+    int threads;    // request worker threads
+    int extents;    // map new files by extents
+    double entry_timeout;
+    double attr_timeout;
+    double negative_timeout;
+};
+
+#define CHFS_OPT(t, p, v) { t, offsetof(struct chfs_options, p), v }
+
+static struct fuse_opt chfs_opts[] = {
+    CHFS_OPT("strictatime", atime, extent_protocol::STRICTATIME),
+    CHFS_OPT("relatime", atime, extent_protocol::RELATIME),
+    CHFS_OPT("noatime", atime, extent_protocol::NOATIME),
+    CHFS_OPT("lazytime", atime, extent_protocol::LAZYTIME),
+    CHFS_OPT("writeback=%d", writeback, 0),
+    CHFS_OPT("threads=%d", threads, 0),
+    CHFS_OPT("extents", extents, 1),
+    CHFS_OPT("noextents", extents, 0),
+    CHFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+    CHFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+    CHFS_OPT("negative_timeout=%lf", negative_timeout, 0),
+    FUSE_OPT_END
+};
+
+//
+// One request worker: receive and dispatch requests until the session
+// ends. fuse_session_loop_mt() starts up to a fixed number of workers
+// on its own, so chfs runs its own loop to make that a mount option.
+//
+static void *
+fuseserver_worker(void *arg)
+{
+    struct fuse_session *se = (struct fuse_session *) arg;
+    struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+    size_t bufsize = fuse_chan_bufsize(ch);
+    std::vector<char> buf(bufsize);
+
+    while (!fuse_session_exited(se)) {
+        struct fuse_chan *tmpch = ch;
+        int res = fuse_chan_recv(&tmpch, &buf[0], bufsize);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0) {
+            fuse_session_exit(se);
+            break;
+        }
+        fuse_session_process(se, &buf[0], res, tmpch);
+    }
+    return NULL;
+}
+
+//
+// Log chfs's statistics each time the process gets SIGUSR1, which
+// every other thread blocks.
+//
+static void *
+fuseserver_stats(void *arg)
+{
+    sigset_t *set = (sigset_t *) arg;
+    int sig;
+
+    while (sigwait(set, &sig) == 0)
+        chfs->print_stats();
+    return NULL;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -479,8 +675,15 @@ main(int argc, char *argv[])
         exit(1);
     }
 #endif
-    if(argc != 2){
-        fprintf(stderr, "Usage: chfs_client <mountpoint>\n");
+    if(argc < 2){
+        fprintf(stderr, "Usage: chfs_client <mountpoint> [-o options]\n"
+                "  -o strictatime|relatime|noatime|lazytime\n"
+                "  -o writeback=<seconds>\n"
+                "  -o threads=<n>\n"
+                "  -o extents|noextents (map new files by extents or not)\n"
+                "  -o entry_timeout=<seconds>,attr_timeout=<seconds>\n"
+                "  -o negative_timeout=<seconds>\n"
+                "kill -USR1 logs cache and lock statistics\n");
         exit(1);
     }
     mountpoint = argv[1];
@@ -489,9 +692,6 @@ main(int argc, char *argv[])
 
     myid = random();
 
-    // chfs = new chfs_client(argv[2], argv[3]);
-    chfs = new chfs_client();
-
     fuseserver_oper.getattr    = fuseserver_getattr;
     fuseserver_oper.statfs     = fuseserver_statfs;
     fuseserver_oper.readdir    = fuseserver_readdir;
@@ -504,13 +704,15 @@ main(int argc, char *argv[])
     fuseserver_oper.setattr    = fuseserver_setattr;
     fuseserver_oper.unlink     = fuseserver_unlink;
     fuseserver_oper.mkdir      = fuseserver_mkdir;
+    fuseserver_oper.fsync      = fuseserver_fsync;
+    fuseserver_oper.release    = fuseserver_release;
     /** Your code here for Lab.
      * you may want to add
      * routines here to implement symbolic link,
      * rmdir, etc.
      * */
 
-    const char *fuse_argv[20];
+    std::vector<const char *> fuse_argv(argc + 20);
     int fuse_argc = 0;
     fuse_argv[fuse_argc++] = argv[0];
 #ifdef __APPLE__
@@ -526,8 +728,41 @@ main(int argc, char *argv[])
 
     fuse_argv[fuse_argc++] = mountpoint;
     fuse_argv[fuse_argc++] = "-d";
+    for (int i = 2; i < argc; ++i)
+        fuse_argv[fuse_argc++] = argv[i];
+
+    fuse_args args = FUSE_ARGS_INIT( fuse_argc, (char **) &fuse_argv[0] );
+
+    struct chfs_options opts;
+    opts.atime = extent_protocol::STRICTATIME;
+    opts.writeback = WCACHE_EXPIRE;
+    opts.threads = 4;
+    opts.extents = 0;
+    opts.entry_timeout = entry_timeout;
+    opts.attr_timeout = attr_timeout;
+    opts.negative_timeout = negative_timeout;
+    if (fuse_opt_parse(&args, &opts, chfs_opts, NULL) == -1) {
+        fprintf(stderr, "fuse_opt_parse failed\n");
+        return 1;
+    }
+
+    entry_timeout = opts.entry_timeout;
+    attr_timeout = opts.attr_timeout;
+    negative_timeout = opts.negative_timeout;
+
+    // threads started from here on inherit the blocked SIGUSR1
+    static sigset_t stats_set;
+    pthread_t stats_th;
+    sigemptyset(&stats_set);
+    sigaddset(&stats_set, SIGUSR1);
+    VERIFY(pthread_sigmask(SIG_BLOCK, &stats_set, NULL) == 0);
+
+    // chfs = new chfs_client(argv[2], argv[3]);
+    chfs = new chfs_client(opts.atime, opts.writeback,
+            opts.extents ? extent_protocol::EXTENTS : 0);
+    VERIFY(pthread_create(&stats_th, NULL, fuseserver_stats, &stats_set) == 0);
+    VERIFY(pthread_detach(stats_th) == 0);
 
-    fuse_args args = FUSE_ARGS_INIT( fuse_argc, (char **) fuse_argv );
     int foreground;
     int res = fuse_parse_cmdline( &args, &mountpoint, 0 /*multithreaded*/, 
             &foreground );
@@ -560,12 +795,36 @@ main(int argc, char *argv[])
     }
 
     fuse_session_add_chan(se, ch);
-    // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
-    err = fuse_session_loop(se);
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 8)
+    pthread_t invalidator;
+    inval_ch = ch;
+    VERIFY(pthread_create(&invalidator, NULL, fuseserver_invalidator, NULL) == 0);
+#endif
+    if (opts.threads <= 1) {
+        err = fuse_session_loop(se);
+    } else {
+        std::vector<pthread_t> workers(opts.threads);
+        for (int i = 0; i < opts.threads; ++i)
+            VERIFY(pthread_create(&workers[i], NULL, fuseserver_worker, se) == 0);
+        for (int i = 0; i < opts.threads; ++i)
+            VERIFY(pthread_join(workers[i], NULL) == 0);
+        err = 0;
+    }
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 8)
+    VERIFY(pthread_mutex_lock(&inval_m) == 0);
+    inval_stopping = true;
+    VERIFY(pthread_cond_signal(&inval_cond) == 0);
+    VERIFY(pthread_mutex_unlock(&inval_m) == 0);
+    VERIFY(pthread_join(invalidator, NULL) == 0);
+#endif
 
     fuse_session_destroy(se);
     close(fd);
     fuse_unmount(mountpoint);
 
+    // write back everything still cached
+    delete chfs;
+
     return err ? 1 : 0;
 }
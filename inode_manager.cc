@@ -1,126 +1,346 @@
 #include "inode_manager.h"
+#include "lang/verify.h"
+#include "slock.h"
+#include "method_thread.h"
+#include <cstddef>
 #include <cstring>
 #include <ctime>
 #include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 // Block containing free inode bitmap
-#define FIBBLOCK (BLOCK_NUM/BPB + 2)
+#define FIBBLOCK(nblocks) ((nblocks)/BPB + 2)
 
 // First block containg data
-#define FDBLOCK (BLOCK_NUM/BPB + INODE_NUM/IPB + 3)
+#define FDBLOCK(nblocks) ((nblocks)/BPB + INODE_NUM/IPB + 3)
+
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
+#define MAX(a,b) ((a)>(b) ? (a) : (b))
 
 // disk layer -----------------------------------------
 
+// Largest image, in whole bitmap blocks, whose size in bytes the
+// superblock can record.
+#define DISK_UNIT      ((size_t) BPB * BLOCK_SIZE)
+#define DISK_SIZE_MAX  ((size_t) UINT32_MAX / DISK_UNIT * DISK_UNIT)
+
 disk::disk()
 {
-  bzero(blocks, sizeof(blocks));
+  const char *image = getenv("CHFS_DISK_IMAGE");
+  const char *env;
+  char *end;
+  unsigned long long v;
+  size_t size = DISK_SIZE;
+  struct stat st;
+
+  blocks = NULL;
+  fd = -1;
+  sync_every = 0;
+  nwrites = 0;
+  dirty_lo = dirty_hi = 0;
+  VERIFY(pthread_mutex_init(&m, NULL) == 0);
+
+  if ((env = getenv("CHFS_DISK_SIZE")) != NULL) {
+    v = strtoull(env, &end, 0);
+    if (*env == '\0' || *end != '\0' || v == 0 || v > DISK_SIZE_MAX) {
+      fprintf(stderr, "disk: CHFS_DISK_SIZE must be 1 to %zu bytes\n",
+              DISK_SIZE_MAX);
+      exit(1);
+    }
+    size = v;
+  }
+  if ((env = getenv("CHFS_DISK_SYNC")) != NULL)
+    sync_every = atoi(env);
+
+  if (image == NULL) {
+    map(size);
+    return;
+  }
+
+  fd = open(image, O_RDWR | O_CREAT, 0644);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(image);
+    exit(1);
+  }
+
+  // an existing image knows its own size
+  if (st.st_size >= 2 * BLOCK_SIZE) {
+    superblock_t sb;
+    if (pread(fd, &sb, sizeof(sb), BLOCK_SIZE) == sizeof(sb) &&
+        sb.magic == CHFS_MAGIC)
+      size = sb.size;
+  }
+
+  map(size);
+}
+
+// Map @size bytes (rounded up to whole bitmap blocks) of the image,
+// growing the image file first if needed.
+void
+disk::map(size_t size)
+{
+  struct stat st;
+  void *p;
+
+  size = (size + DISK_UNIT - 1) / DISK_UNIT * DISK_UNIT;
+  nblocks = size / BLOCK_SIZE;
+
+  if (fd < 0) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  } else {
+    if (fstat(fd, &st) < 0 ||
+        (st.st_size < (off_t) size && ftruncate(fd, size) < 0)) {
+      perror("disk: grow image");
+      exit(1);
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+
+  if (p == MAP_FAILED) {
+    perror("disk: mmap");
+    exit(1);
+  }
+  blocks = (unsigned char *) p;
+}
+
+disk::~disk()
+{
+  sync();
+  munmap(blocks, (size_t) nblocks * BLOCK_SIZE);
+  if (fd >= 0)
+    close(fd);
+  VERIFY(pthread_mutex_destroy(&m) == 0);
 }
 
 void
 disk::read_block(blockid_t id, char *buf)
 {
-  memcpy(buf, blocks[id], BLOCK_SIZE);
+  memcpy(buf, blocks + (size_t) id * BLOCK_SIZE, BLOCK_SIZE);
 }
 
 void
 disk::write_block(blockid_t id, const char *buf)
 {
-  memcpy(blocks[id], buf, BLOCK_SIZE);
+  bool full;
+
+  memcpy(blocks + (size_t) id * BLOCK_SIZE, buf, BLOCK_SIZE);
+
+  if (fd < 0)
+    return;
+  {
+    ScopedLock ml(&m);
+    if (dirty_lo == dirty_hi) {
+      dirty_lo = id;
+      dirty_hi = id + 1;
+    } else {
+      dirty_lo = MIN(dirty_lo, id);
+      dirty_hi = MAX(dirty_hi, id + 1);
+    }
+    full = sync_every > 0 && ++nwrites >= sync_every;
+  }
+  if (full)
+    sync();
 }
 
-// block layer -----------------------------------------
+// Length of the run starting at ids[i] whose block ids and buffers
+// are both contiguous, so it can be moved with a single copy. Only the
+// last buffer of a run may be shorter than a block.
+static int
+contiguous_run(const blockid_t *ids, int n, const struct iovec *iov, int i)
+{
+  int j = i;
 
-// Allocate a free disk block.
-blockid_t
-block_manager::alloc_block()
+  while (j + 1 < n && ids[j + 1] == ids[j] + 1 &&
+         iov[j].iov_len == BLOCK_SIZE &&
+         (char *) iov[j + 1].iov_base == (char *) iov[j].iov_base + BLOCK_SIZE)
+    ++j;
+  return j - i + 1;
+}
+
+// Read block ids[i] into dst[i] (at most iov_len bytes) for each i.
+void
+disk::read_blocks(const blockid_t *ids, int n, const struct iovec *dst)
 {
-  /*
-   * your code goes here.
-   * note: you should mark the corresponding bit in block bitmap when alloc.
-   * you need to think about which block you can start to be allocated.
-   */
-  // Check from the bit in bitmap corresponding to the first data block
-  // find a "0" bit, update the bit and mark in using_blocks
-  blockid_t bnum;
-  char buf[BLOCK_SIZE];
-  bool empty = false;
-  int i, j, k;
-  int len = BLOCK_NUM / BPB;
-  int offset = FDBLOCK % BPB;
-  int start = BBLOCK(FDBLOCK);
-  unsigned char mask;
+  int i, run;
+  size_t len;
 
-  i = start;
-  d->read_block(i, buf);
-  j = offset / 8;
-  mask = 0x80;
-  k = offset % 8;
-  mask = mask >> k;
+  for (i = 0; i < n; i += run) {
+    run = contiguous_run(ids, n, dst, i);
+    len = (size_t) (run - 1) * BLOCK_SIZE + dst[i + run - 1].iov_len;
+    memcpy(dst[i].iov_base, blocks + (size_t) ids[i] * BLOCK_SIZE, len);
+  }
+}
 
-  for (; k < 8; ++k) {
-    if ((buf[j] & mask) == 0) {
-        buf[j] = buf[j] | mask;
-        empty = true;
-        break;
+// Write src[i] to block ids[i] for each i. A buffer shorter than a
+// block leaves the rest of its block zeroed.
+void
+disk::write_blocks(const blockid_t *ids, int n, const struct iovec *src)
+{
+  int i, run;
+  size_t len;
+  unsigned char *p;
+  bool full = false;
+
+  for (i = 0; i < n; i += run) {
+    run = contiguous_run(ids, n, src, i);
+    len = (size_t) (run - 1) * BLOCK_SIZE + src[i + run - 1].iov_len;
+    p = blocks + (size_t) ids[i] * BLOCK_SIZE;
+    memcpy(p, src[i].iov_base, len);
+    memset(p + len, 0, (size_t) run * BLOCK_SIZE - len);
+
+    if (fd < 0)
+      continue;
+    ScopedLock ml(&m);
+    if (dirty_lo == dirty_hi) {
+      dirty_lo = ids[i];
+      dirty_hi = ids[i] + run;
+    } else {
+      dirty_lo = MIN(dirty_lo, ids[i]);
+      dirty_hi = MAX(dirty_hi, ids[i] + run);
     }
-    mask = mask >> 1;
+    nwrites += run;
+    full = sync_every > 0 && nwrites >= sync_every;
   }
 
-  if (!empty) {
-    for (++j; j < BLOCK_SIZE; ++j) {
-      mask = 0x80;
+  if (full)
+    sync();
+}
 
-      for (k = 0; k < 8; ++k) {
-        if ((buf[j] & mask) == 0) {
-          buf[j] = buf[j] | mask;
-          empty = true;
-          break;
-        }
-        mask = mask >> 1;
-      }
+// Flush the dirty range of the image to stable storage.
+void
+disk::sync()
+{
+  ScopedLock ml(&m);
+  size_t pgsz = sysconf(_SC_PAGESIZE);
+  size_t lo, hi;
 
-      if (empty)
-        break;
-    }
-  }
-  d->write_block(i, buf);
+  if (fd < 0 || dirty_lo == dirty_hi)
+    return;
 
-  if (!empty) {
-    for (++i; i < len; ++i) {
-      d->read_block(i, buf);
+  lo = (size_t) dirty_lo * BLOCK_SIZE / pgsz * pgsz;
+  hi = (size_t) dirty_hi * BLOCK_SIZE;
+  if (msync(blocks + lo, hi - lo, MS_SYNC) < 0)
+    perror("disk: msync");
 
-      for (j = 0; j < BLOCK_SIZE; ++j) {
-        mask = 0x80;
+  dirty_lo = dirty_hi = 0;
+  nwrites = 0;
+}
 
-        for (k = 0; k < 8; ++k) {
-          if ((buf[j] & mask) == 0) {
-            buf[j] = buf[j] | mask;
-            empty = true;
-            break;
-          }
-          mask = mask >> 1;
-        }
+// block layer -----------------------------------------
 
-        if (empty)
-          break;
-      }
+// Number of bitmap changes after which the dirty bitmap blocks are
+// written back.
+#define BITMAP_BATCH 128
 
-      d->write_block(i, buf);
-      if (empty)
-        break;
+// Load 64 bits of a bitmap so that the bit of the lowest numbered
+// block (the 0x80 bit of the first byte) is bit 63.
+static inline uint64_t
+bitmap_word(const char *p)
+{
+  uint64_t w;
+
+  memcpy(&w, p, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  w = __builtin_bswap64(w);
+#endif
+  return w;
+}
+
+// Find the first bit equal to @value in [from, to) of a bitmap.
+// Return its index, or @to if there is none.
+static uint32_t
+find_bit(const char *bitmap, uint32_t from, uint32_t to, bool value)
+{
+  uint64_t flip = value ? 0 : ~0ULL;
+  uint32_t w = from / 64;
+  uint64_t word;
+
+  if (from >= to)
+    return to;
+
+  // the wanted bits are ones in @word; drop those before @from
+  word = bitmap_word(bitmap + w * 8) ^ flip;
+  word &= ~0ULL >> (from % 64);
+
+  while (word == 0) {
+    if (++w * 64 >= to)
+      return to;
+    word = bitmap_word(bitmap + w * 8) ^ flip;
+  }
+
+  return MIN(w * 64 + __builtin_clzll(word), to);
+}
+
+// Allocate a free disk block.
+// The search is next-fit: it resumes after the last allocated block
+// and wraps around to the first data block.
+blockid_t
+block_manager::alloc_block()
+{
+  /*
+   * your code goes here.
+   * note: you should mark the corresponding bit in block bitmap when alloc.
+   * you need to think about which block you can start to be allocated.
+   */
+  ScopedLock ml(&bitmap_m);
+  blockid_t first = FDBLOCK(sb.nblocks);
+  blockid_t b;
+
+  if (next_free < first || next_free >= sb.nblocks)
+    next_free = first;
+
+  b = find_bit(bitmap, next_free, sb.nblocks, false);
+  if (b == sb.nblocks) {
+    b = find_bit(bitmap, first, next_free, false);
+    if (b == next_free) {
+      printf("No extra block to allocate.\n");
+      exit(1);
     }
   }
 
-  if (empty) {
-    bnum = (i - start) * BPB + j * 8 + k;
-    using_blocks.insert(std::pair<uint32_t, int>(bnum, 0));
+  mark_blocks(b, 1, true);
+  next_free = b + 1;
+  return b;
+}
+
+// Allocate up to @count contiguous blocks and return the first one,
+// with the number actually allocated in @len. The run continues at
+// @hint when that block is free; otherwise it comes from the smallest
+// free extent that holds @count blocks, or the largest one if none do.
+blockid_t
+block_manager::alloc_extent(uint32_t count, blockid_t hint, uint32_t &len)
+{
+  ScopedLock ml(&bitmap_m);
+  blockid_t first = FDBLOCK(sb.nblocks);
+  std::set<std::pair<uint32_t, blockid_t> >::iterator bt;
+  blockid_t start;
+
+  refresh_free_extents();
+  if (hint >= first && hint < sb.nblocks &&
+      find_bit(bitmap, hint, hint + 1, false) == hint) {
+    start = hint;
+    len = find_bit(bitmap, hint, MIN(hint + count, sb.nblocks), true) - hint;
+    goto found;
   }
-  else {
+
+  if (free_by_len.empty()) {
     printf("No extra block to allocate.\n");
     exit(1);
   }
-  
-  return bnum;
+  bt = free_by_len.lower_bound(std::make_pair(count, (blockid_t) 0));
+  if (bt == free_by_len.end())
+    --bt;
+  start = bt->second;
+  len = MIN(count, bt->first);
+
+found:
+  mark_blocks(start, len, true);
+  return start;
 }
 
 void
@@ -130,48 +350,196 @@ block_manager::free_block(uint32_t id)
    * your code goes here.
    * note: you should unmark the corresponding bit in the block bitmap when free.
    */
-  uint32_t bblock_id;
-  int offset, index;
-  char buf[BLOCK_SIZE];
+  ScopedLock ml(&bitmap_m);
+  if (id < FDBLOCK(sb.nblocks) || id >= sb.nblocks) {
+    printf("\tbm: block id out of range\n");
+    return;
+  }
+
+  if (find_bit(bitmap, id, id + 1, true) != id) {
+    printf("\tbm: block %u is already free\n", id);
+    return;
+  }
+
+  mark_blocks(id, 1, false);
+}
+
+// Set or clear the bits of blocks [start, start + len) in the
+// in-memory bitmap, and mark the free extent index stale there. The
+// caller holds bitmap_m.
+void
+block_manager::mark_blocks(blockid_t start, uint32_t len, bool used)
+{
+  blockid_t b;
   unsigned char mask;
 
-  if (id < FDBLOCK || id >= BLOCK_NUM) {
-    printf("\tbm: block id out of range\n");
+  for (b = start; b < start + len; ++b) {
+    mask = 0x80 >> b % 8;
+    if (used)
+      bitmap[b / 8] |= mask;
+    else
+      bitmap[b / 8] &= ~mask;
+    bitmap_dirty[b / BPB] = true;
+    index_stale[b / BPB] = true;
+  }
+  index_changed = true;
+
+  if (used)
+    sb.free_blocks -= len;
+  else
+    sb.free_blocks += len;
+  bitmap_changes += len;
+  if (bitmap_changes >= BITMAP_BATCH)
+    flush_bitmap();
+}
+
+// Write the changed blocks of the in-memory bitmap back to disk,
+// and the superblock with its free counts. The caller holds bitmap_m.
+void
+block_manager::flush_bitmap()
+{
+  char buf[BLOCK_SIZE];
+
+  for (uint32_t i = 0; i < bitmap_dirty.size(); ++i) {
+    if (!bitmap_dirty[i])
+      continue;
+    d->write_block(BBLOCK(i * BPB), bitmap + i * BLOCK_SIZE);
+    bitmap_dirty[i] = false;
+  }
+  bitmap_changes = 0;
+
+  memset(buf, 0, sizeof(buf));
+  *((superblock_t *) buf) = sb;
+  d->write_block(1, buf);
+}
+
+// Bring the free extent index up to date with the bitmap over
+// [lo, hi). The extents that overlap or touch the range are dropped,
+// widening it to cover them, and the free runs of the bitmap there
+// are put back. The index is accurate outside the range, so the runs
+// found cannot continue past it. The caller holds bitmap_m.
+void
+block_manager::index_range(blockid_t lo, blockid_t hi)
+{
+  std::map<blockid_t, uint32_t>::iterator it;
+  blockid_t b, end;
+
+  it = free_extents.upper_bound(lo);
+  if (it != free_extents.begin()) {
+    --it;
+    if (it->first + it->second < lo)
+      ++it;
+  }
+  while (it != free_extents.end() && it->first <= hi) {
+    lo = MIN(lo, it->first);
+    hi = MAX(hi, it->first + it->second);
+    free_by_len.erase(std::make_pair(it->second, it->first));
+    free_extents.erase(it++);
+  }
+
+  for (b = find_bit(bitmap, lo, hi, false); b < hi;
+       b = find_bit(bitmap, end, hi, false)) {
+    end = find_bit(bitmap, b, hi, true);
+    free_extents[b] = end - b;
+    free_by_len.insert(std::make_pair(end - b, b));
+  }
+}
+
+// Re-index the bitmap blocks changed since the last call, a run of
+// adjacent ones at a time. The caller holds bitmap_m.
+void
+block_manager::refresh_free_extents()
+{
+  uint32_t i, j;
+
+  if (!index_changed)
     return;
+  for (i = 0; i < index_stale.size(); i = j) {
+    if (!index_stale[i]) {
+      j = i + 1;
+      continue;
+    }
+    for (j = i; j < index_stale.size() && index_stale[j]; ++j)
+      index_stale[j] = false;
+    index_range(MAX(i * BPB, FDBLOCK(sb.nblocks)), j * BPB);
   }
+  index_changed = false;
+}
 
-  using_blocks.erase(id);
+// Add delta to the free inode count.
+void
+block_manager::count_inodes(int delta)
+{
+  ScopedLock ml(&bitmap_m);
+  sb.free_inodes += delta;
+}
 
-  bblock_id = BBLOCK(id);
-  offset = id % BPB;
-  d->read_block(bblock_id, buf);
-  mask = 0x80;
-  mask = ~(mask >> offset % 8);
-  index = offset / 8;
-  buf[index] = buf[index] & mask;
-  d->write_block(bblock_id, buf);
+void
+block_manager::statfs(uint32_t &free_blocks, uint32_t &free_inodes)
+{
+  ScopedLock ml(&bitmap_m);
+  free_blocks = sb.free_blocks;
+  free_inodes = sb.free_inodes;
 }
 
 // The layout of disk should be like this:
 // |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
+// An image that already carries a superblock is mounted as is.
 block_manager::block_manager()
 {
   d = new disk();
   char buf[BLOCK_SIZE];
+  next_free = 0;
+  VERIFY(pthread_mutex_init(&bitmap_m, NULL) == 0);
+
+  d->read_block(1, buf);
+  sb = *((superblock_t *) buf);
+  if (sb.magic == CHFS_MAGIC && sb.version != CHFS_VERSION) {
+    printf("\tbm: disk format version %u, expected %u\n",
+           sb.version, CHFS_VERSION);
+    exit(1);
+  }
+  if (sb.magic == CHFS_MAGIC && sb.nblocks != d->size()) {
+    printf("\tbm: superblock says %u blocks, the image has %u\n",
+           sb.nblocks, d->size());
+    exit(1);
+  }
+  if (sb.magic != CHFS_MAGIC) {
+    // format the disk
+    memset(buf, 0, sizeof(buf));
+    for (blockid_t i = 0; i < FDBLOCK(d->size()); ++i)
+      d->write_block(i, buf);
 
-  // format the disk
-  sb.size = BLOCK_SIZE * BLOCK_NUM;
-  sb.nblocks = BLOCK_NUM;
-  sb.ninodes = INODE_NUM;
-  
-  *((superblock_t *) buf) = sb;
+    sb.magic = CHFS_MAGIC;
+    sb.size = BLOCK_SIZE * d->size();
+    sb.nblocks = d->size();
+    sb.ninodes = INODE_NUM;
+    sb.version = CHFS_VERSION;
+    sb.free_blocks = d->size() - FDBLOCK(d->size());
+    sb.free_inodes = INODE_NUM - 1;  // inode 0 is never used
 
-  d->write_block(1, buf);
+    *((superblock_t *) buf) = sb;
+
+    d->write_block(1, buf);
+  }
+
+  // load the block bitmap into memory
+  VERIFY(posix_memalign((void **) &bitmap, 64, sb.nblocks / 8) == 0);
+  bitmap_dirty.assign(sb.nblocks / BPB, false);
+  bitmap_changes = 0;
+  for (uint32_t i = 0; i < sb.nblocks / BPB; ++i)
+    d->read_block(BBLOCK(i * BPB), bitmap + i * BLOCK_SIZE);
+  index_stale.assign(sb.nblocks / BPB, false);
+  index_changed = false;
+  index_range(FDBLOCK(sb.nblocks), sb.nblocks);
 }
 
 block_manager::~block_manager()
 {
+    flush_bitmap();
+    free(bitmap);
     delete d;
+    VERIFY(pthread_mutex_destroy(&bitmap_m) == 0);
 }
 
 void
@@ -186,16 +554,57 @@ block_manager::write_block(uint32_t id, const char *buf)
   d->write_block(id, buf);
 }
 
+void
+block_manager::read_blocks(const blockid_t *ids, int n,
+                           const struct iovec *dst)
+{
+  d->read_blocks(ids, n, dst);
+}
+
+void
+block_manager::write_blocks(const blockid_t *ids, int n,
+                            const struct iovec *src)
+{
+  d->write_blocks(ids, n, src);
+}
+
+void
+block_manager::sync()
+{
+  {
+    ScopedLock ml(&bitmap_m);
+    flush_bitmap();
+  }
+  d->sync();
+}
+
 // inode layer -----------------------------------------
 
-inode_manager::inode_manager()
+inode_manager::inode_manager(int atime_policy)
 {
   char buf[BLOCK_SIZE];
   bm = new block_manager();
-  bm->read_block(FIBBLOCK, buf);
+  memset(icache, 0, sizeof(icache));
+  memset(pcache, 0, sizeof(pcache));
+  VERIFY(pthread_mutex_init(&icache_m, NULL) == 0);
+  VERIFY(pthread_mutex_init(&pcache_m, NULL) == 0);
+  VERIFY(pthread_mutex_init(&ialloc_m, NULL) == 0);
+  VERIFY(pthread_cond_init(&expire_cond, NULL) == 0);
+  stopping = false;
+  this->atime_policy = atime_policy;
+  expire_th = method_thread(this, false, &inode_manager::expirer);
+
+  // the root directory survives on a persistent image
+  struct inode *root = get_inode(1);
+  if (root != NULL) {
+    release_inode(root);
+    return;
+  }
+
+  bm->read_block(FIBBLOCK(bm->sb.nblocks), buf);
   buf[0] |= 0x80;
-  bm->write_block(FIBBLOCK, buf);
-  uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
+  bm->write_block(FIBBLOCK(bm->sb.nblocks), buf);
+  uint32_t root_dir = alloc_inode(extent_protocol::T_DIR, 0);
   if (root_dir != 1) {
     printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
     exit(0);
@@ -204,13 +613,26 @@ inode_manager::inode_manager()
 
 inode_manager::~inode_manager()
 {
+    {
+      ScopedLock ml(&icache_m);
+      stopping = true;
+      VERIFY(pthread_cond_signal(&expire_cond) == 0);
+    }
+    VERIFY(pthread_join(expire_th, NULL) == 0);
+    sync();
+    for (size_t i = 0; i < overflow.size(); ++i)
+      delete overflow[i];
     delete bm;
+    VERIFY(pthread_mutex_destroy(&icache_m) == 0);
+    VERIFY(pthread_mutex_destroy(&pcache_m) == 0);
+    VERIFY(pthread_mutex_destroy(&ialloc_m) == 0);
+    VERIFY(pthread_cond_destroy(&expire_cond) == 0);
 }
 
-/* Create a new file.
+/* Create a new file with the given inode flags (I_EXTENTS or 0).
  * Return its inum. */
 uint32_t
-inode_manager::alloc_inode(uint32_t type)
+inode_manager::alloc_inode(uint32_t type, unsigned short flags)
 {
   /* 
    * your code goes here.
@@ -224,7 +646,8 @@ inode_manager::alloc_inode(uint32_t type)
   bool empty = false;
   int i, j;
 
-  bm->read_block(FIBBLOCK, buf);
+  ScopedLock ml(&ialloc_m);
+  bm->read_block(FIBBLOCK(bm->sb.nblocks), buf);
 
   for (i = 0; i < len; ++i) {
     unsigned char mask = 0x80;
@@ -249,13 +672,16 @@ inode_manager::alloc_inode(uint32_t type)
     exit(1);
   }
 
+  memset(&ino, 0, sizeof(ino));
   ino.type = type;
+  ino.flags = flags;
   ino.size = 0;
   ino.atime = (unsigned int) time(NULL);
   ino.mtime = (unsigned int) time(NULL);
   ino.ctime = (unsigned int) time(NULL);
 
-  bm->write_block(FIBBLOCK, buf);
+  bm->write_block(FIBBLOCK(bm->sb.nblocks), buf);
+  bm->count_inodes(-1);
   put_inode(inum, &ino);
 
   return inum;
@@ -274,36 +700,222 @@ inode_manager::free_inode(uint32_t inum)
   int index, offset;
   unsigned char mask;
 
+  // clear the inode before its bit, which lets alloc_inode reuse it
+  ino = get_inode(inum);
+  if (ino != NULL) {
+    ino->type = 0;
+    put_inode(inum, ino);
+    release_inode(ino);
+  }
+
   index = inum / 8;
   offset = inum % 8;
-  bm->read_block(FIBBLOCK, buf);
   mask = 0x80;
   mask = mask >> offset;
 
+  ScopedLock ml(&ialloc_m);
+  bm->read_block(FIBBLOCK(bm->sb.nblocks), buf);
   if ((buf[index] & mask) != 0) {
     mask = ~mask;
     buf[index] &= mask;
-    bm->write_block(FIBBLOCK, buf);
+    bm->write_block(FIBBLOCK(bm->sb.nblocks), buf);
+    bm->count_inodes(1);
   }
+}
 
-  ino = get_inode(inum);
-  if (ino != NULL) {
-    ino->type = 0;
-    put_inode(inum, ino);
-    free(ino);
+
+// inode cache -----------------------------------------
+
+#define ICACHE_HASH(inum) (((inum) * 2654435761u) >> (32 - ICACHE_BITS))
+
+/* Return the cache entry of inode inum, or NULL if it is not cached.
+ * This and the other icache functions are called with icache_m held. */
+inode_manager::icache_entry *
+inode_manager::icache_lookup(uint32_t inum)
+{
+  uint32_t h = ICACHE_HASH(inum);
+  icache_entry *e;
+
+  for (int p = 0; p < ICACHE_PROBE; ++p) {
+    e = &icache[(h + p) % ICACHE_SIZE];
+    if (e->inum == inum) {
+      e->referenced = true;
+      return e;
+    }
+  }
+  for (size_t i = 0; i < overflow.size(); ++i) {
+    if (overflow[i]->inum == inum)
+      return overflow[i];
+  }
+  return NULL;
+}
+
+/* Find a free slot for inode inum in its probe window. If there is
+ * none and evict is set, evict the first unpinned entry whose CLOCK
+ * bit is clear, writing it back if dirty. Return NULL on failure. */
+inode_manager::icache_entry *
+inode_manager::icache_victim(uint32_t inum, bool evict)
+{
+  uint32_t h = ICACHE_HASH(inum);
+  icache_entry *e;
+  int p;
+
+  for (p = 0; p < ICACHE_PROBE; ++p) {
+    e = &icache[(h + p) % ICACHE_SIZE];
+    if (e->inum == 0)
+      return e;
+  }
+  if (!evict)
+    return NULL;
+
+  // two sweeps: the first may only clear CLOCK bits
+  for (p = 0; p < 2 * ICACHE_PROBE; ++p) {
+    e = &icache[(h + p % ICACHE_PROBE) % ICACHE_SIZE];
+    if (e->pins > 0)
+      continue;
+    if (e->referenced) {
+      e->referenced = false;
+      continue;
+    }
+    if (e->dirty || e->lazy)
+      write_inode(e);
+    e->inum = 0;
+    return e;
+  }
+  return NULL;
+}
+
+/* Return a slot for inode inum: one in its probe window if any can be
+ * had, or else a new overflow entry. */
+inode_manager::icache_entry *
+inode_manager::icache_slot(uint32_t inum)
+{
+  icache_entry *e;
+
+  e = icache_victim(inum, true);
+  if (e != NULL) {
+    e->overflow = false;
+    return e;
+  }
+  printf("\tim: icache window of %u all pinned\n", inum);
+  e = new icache_entry;
+  e->overflow = true;
+  overflow.push_back(e);
+  return e;
+}
+
+/* Write back and free an unpinned overflow entry. */
+void
+inode_manager::icache_drop(icache_entry *e)
+{
+  if (e->dirty || e->lazy)
+    write_inode(e);
+  for (size_t i = 0; i < overflow.size(); ++i) {
+    if (overflow[i] == e) {
+      overflow[i] = overflow.back();
+      overflow.pop_back();
+      break;
+    }
+  }
+  delete e;
+}
+
+/* Read the inode block holding inum and cache inum. The other inodes
+ * of the block are cached too if they have a free slot. */
+inode_manager::icache_entry *
+inode_manager::icache_load(uint32_t inum)
+{
+  char buf[BLOCK_SIZE];
+  icache_entry *e, *ret = NULL;
+  uint32_t i;
+
+  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
+
+  for (i = inum - inum % IPB; i < inum - inum % IPB + IPB; ++i) {
+    if (i == inum) {
+      e = icache_slot(i);
+      ret = e;
+    } else if (i == 0 || icache_lookup(i) != NULL ||
+               (e = icache_victim(i, false)) == NULL)
+      continue;
+    else
+      e->overflow = false;
+
+    e->inum = i;
+    e->pins = 0;
+    e->dirty = false;
+    e->lazy = false;
+    e->referenced = (i == inum);
+    memcpy(&e->ino, buf + i % IPB * INODE_SIZE, sizeof(inode_t));
+    e->saved = e->ino;
+  }
+
+  return ret;
+}
+
+/* Write a cached inode back to its slot, along with any other dirty
+ * cached inodes of the same block. What is written is each inode as
+ * of its last put_inode, so one being changed meanwhile is never
+ * written half done. */
+void
+inode_manager::write_inode(icache_entry *e)
+{
+  char buf[BLOCK_SIZE];
+  icache_entry *s;
+  uint32_t i;
+
+  bm->read_block(IBLOCK(e->inum, bm->sb.nblocks), buf);
+  for (i = e->inum - e->inum % IPB; i < e->inum - e->inum % IPB + IPB; ++i) {
+    s = (i == e->inum) ? e : icache_lookup(i);
+    if (s == NULL || (s != e && !s->dirty && !s->lazy))
+      continue;
+    memcpy(buf + i % IPB * INODE_SIZE, &s->saved, sizeof(inode_t));
+    s->dirty = false;
+    s->lazy = false;
+  }
+  bm->write_block(IBLOCK(e->inum, bm->sb.nblocks), buf);
+}
+
+/* Write back the inodes that have been dirty for too long. */
+void
+inode_manager::write_expired()
+{
+  time_t now = time(NULL);
+  icache_entry *e;
+
+  for (size_t i = 0; i < ICACHE_SIZE + overflow.size(); ++i) {
+    e = i < ICACHE_SIZE ? &icache[i] : overflow[i - ICACHE_SIZE];
+    if (e->inum == 0 || (!e->dirty && !e->lazy))
+      continue;
+    if (e->dirtied + (e->dirty ? DIRTY_EXPIRE : LAZYTIME_EXPIRE) <= now)
+      write_inode(e);
   }
 }
 
+/* Once a second, write back the inodes that have expired, so that
+ * they reach the disk even if nothing touches the cache. */
+void
+inode_manager::expirer()
+{
+  ScopedLock ml(&icache_m);
+  struct timeval now;
+  struct timespec next;
+
+  while (!stopping) {
+    gettimeofday(&now, NULL);
+    next.tv_sec = now.tv_sec + 1;
+    next.tv_nsec = now.tv_usec * 1000;
+    pthread_cond_timedwait(&expire_cond, &icache_m, &next);
+    write_expired();
+  }
+}
 
-/* Return an inode structure by inum, NULL otherwise.
- * Caller should release the memory. */
+/* Return a reference to the cached inode inum, NULL otherwise.
+ * Caller should drop it with release_inode(). */
 struct inode* 
 inode_manager::get_inode(uint32_t inum)
 {
-  struct inode *ino, *ino_disk;
-  char buf[BLOCK_SIZE];
-  //unsigned char mask;
-  //int index, offset;
+  icache_entry *e;
 
   printf("\tim: get_inode %d\n", inum);
 
@@ -311,120 +923,777 @@ inode_manager::get_inode(uint32_t inum)
     printf("\tim: inum out of range\n");
     return NULL;
   }
-  /*
-  bm->read_block(FIBBLOCK, buf);
-  index = inum / 8;
-  offset = inum % 8;
-  mask = 0x80;
-  mask = mask >> offset;
-  if ((buf[index] & mask) == 0) {
-    printf("\tim: invalid inode number\n");
-    return NULL;
-  }*/
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  // printf("%s:%d\n", __FILE__, __LINE__);
+  ScopedLock ml(&icache_m);
+  e = icache_lookup(inum);
+  if (e == NULL)
+    e = icache_load(inum);
 
-  ino_disk = (struct inode*)buf + inum%IPB;
-  if (ino_disk->type == 0) {
+  if (e->ino.type == 0) {
     printf("\tim: inode not exist\n");
+    if (e->overflow && e->pins == 0)
+      icache_drop(e);
     return NULL;
   }
 
-  ino = (struct inode*)malloc(sizeof(struct inode));
-  *ino = *ino_disk;
-
-  return ino;
+  ++e->pins;
+  return &e->ino;
 }
 
+/* Mark inode inum dirty, copying ino into the cache unless it is
+ * the cached inode itself. It reaches the disk on eviction or sync. */
 void
 inode_manager::put_inode(uint32_t inum, struct inode *ino)
 {
-  char buf[BLOCK_SIZE];
-  struct inode *ino_disk;
+  icache_entry *e;
 
   printf("\tim: put_inode %d\n", inum);
   if (ino == NULL)
     return;
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  ino_disk = (struct inode*)buf + inum%IPB;
-  *ino_disk = *ino;
-  bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+  ScopedLock ml(&icache_m);
+  e = icache_lookup(inum);
+  if (e == NULL) {
+    e = icache_slot(inum);
+    e->inum = inum;
+    e->pins = 0;
+    e->lazy = false;
+    e->referenced = true;
+  }
+  if (&e->ino != ino)
+    e->ino = *ino;
+  e->saved = e->ino;
+  if (!e->dirty && !e->lazy)
+    e->dirtied = time(NULL);
+  e->dirty = true;
+  if (e->overflow && e->pins == 0)
+    icache_drop(e);
 }
 
-#define MIN(a,b) ((a)<(b) ? (a) : (b))
-
-/* Get all the data of a file by inum. 
- * Return alloced data, should be freed by caller. */
 void
-inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
+inode_manager::release_inode(struct inode *ino)
 {
-  /*
-   * your code goes here.
-   * note: read blocks related to inode number inum,
-   * and copy them to buf_out
-   */
-  char buf[BLOCK_SIZE];
-  unsigned int fsize;
-  inode_t *ino = get_inode(inum);
+  icache_entry *e;
 
-  if (ino == NULL) {
-    printf("\tim: file for read not exist\n");
+  ScopedLock ml(&icache_m);
+  e = (icache_entry *) ((char *) ino - offsetof(icache_entry, ino));
+  VERIFY(e->pins > 0);
+  if (--e->pins == 0 && e->overflow)
+    icache_drop(e);
+}
+
+/* Update the atime of a file being read, as the atime policy says.
+ * Readers of one inode may run together, so this is done under
+ * icache_m. */
+void
+inode_manager::touch_atime(uint32_t inum, struct inode *ino)
+{
+  unsigned int now = (unsigned int) time(NULL);
+  icache_entry *e;
+
+  ScopedLock ml(&icache_m);
+  e = (icache_entry *) ((char *) ino - offsetof(icache_entry, ino));
+  switch (atime_policy) {
+  case extent_protocol::NOATIME:
+    return;
+  case extent_protocol::RELATIME:
+    if (ino->atime > ino->mtime && ino->atime > ino->ctime &&
+        now - ino->atime < 24 * 3600)
+      return;
+    break;
+  case extent_protocol::LAZYTIME:
+    // the new atime stays in the cache until the inode is written
+    ino->atime = now;
+    e->saved.atime = now;
+    if (!e->dirty && !e->lazy)
+      e->dirtied = now;
+    e->lazy = true;
     return;
   }
 
-  fsize = ino->size;
-  if (fsize == 0)
-    *buf_out = NULL;
-  else {
-    *buf_out = (char *) malloc(fsize);
-    char idrct_blocks[BLOCK_SIZE];
-    blockid_t *idblocks;
-    int ful_blk, cur_blk, leftover, stop;
-
-    ful_blk = fsize / BLOCK_SIZE;
-    leftover = fsize % BLOCK_SIZE;
-    stop = MIN(ful_blk, NDIRECT);
-
-    for (cur_blk = 0; cur_blk < stop; ++cur_blk) {
-      bm->read_block(ino->blocks[cur_blk], buf);
-      // specified to BLOCK_SIZE
-      memcpy(*buf_out + (cur_blk << 9), buf, BLOCK_SIZE);
+  ino->atime = now;
+  e->saved.atime = now;
+  if (!e->dirty && !e->lazy)
+    e->dirtied = now;
+  e->dirty = true;
+}
+
+/* Write all dirty inodes and allocation state to disk. */
+void
+inode_manager::sync()
+{
+  {
+    ScopedLock ml(&icache_m);
+    for (int i = 0; i < ICACHE_SIZE; ++i) {
+      if (icache[i].inum != 0 && (icache[i].dirty || icache[i].lazy))
+        write_inode(&icache[i]);
     }
+    for (size_t i = 0; i < overflow.size(); ++i) {
+      if (overflow[i]->dirty || overflow[i]->lazy)
+        write_inode(overflow[i]);
+    }
+  }
+  bm->sync();
+}
+
+// NINDIRECT to the power h: the data blocks mapped by a pointer
+// block at height h above the data (a leaf pointer block is height 1).
+static uint32_t
+npow(int h)
+{
+  uint32_t p = 1;
+
+  while (h-- > 0)
+    p *= NINDIRECT;
+  return p;
+}
+
+// First data block mapped by the level l tree.
+static int
+level_base(int l)
+{
+  int base = NDIRECT;
+
+  for (int k = 0; k < l; ++k)
+    base += npow(k + 1);
+  return base;
+}
 
-    if (cur_blk == NDIRECT) {
-      bm->read_block(ino->blocks[NDIRECT], idrct_blocks);
-      idblocks = (blockid_t *) idrct_blocks;
+/* Copy the contents of pointer block id into ptrs, through the
+ * cache, which reads it on a miss. */
+void
+inode_manager::pcache_get(blockid_t id, blockid_t *ptrs)
+{
+  ScopedLock ml(&pcache_m);
+  pcache_entry *e = &pcache[id % PCACHE_SIZE];
+
+  if (e->id != id) {
+    bm->read_block(id, (char *) e->ptrs);
+    e->id = id;
+  }
+  memcpy(ptrs, e->ptrs, BLOCK_SIZE);
+}
 
-      for (; cur_blk < ful_blk; ++cur_blk) {
-        bm->read_block(*(idblocks + (cur_blk - stop)), buf);
-        memcpy(*buf_out + (cur_blk << 9), buf, BLOCK_SIZE);
+/* Write pointer block id through the cache. */
+void
+inode_manager::pcache_put(blockid_t id, const blockid_t *ptrs)
+{
+  ScopedLock ml(&pcache_m);
+  pcache_entry *e = &pcache[id % PCACHE_SIZE];
+
+  memcpy(e->ptrs, ptrs, BLOCK_SIZE);
+  e->id = id;
+  bm->write_block(id, (char *) ptrs);
+}
+
+/* Free pointer block id, which may be reused for data. */
+void
+inode_manager::pcache_free(blockid_t id)
+{
+  {
+    ScopedLock ml(&pcache_m);
+    pcache_entry *e = &pcache[id % PCACHE_SIZE];
+    if (e->id == id)
+      e->id = 0;
+  }
+  bm->free_block(id);
+}
+
+/* Return the address of the pointer block at height h with index j
+ * in the level l tree of ino, walking down from its root. A missing
+ * block on the way is allocated zeroed if alloc is set, otherwise 0
+ * is returned. */
+blockid_t
+inode_manager::map_node(struct inode *ino, int l, int h, uint32_t j,
+                        bool alloc)
+{
+  blockid_t zero[NINDIRECT], ptrs[NINDIRECT], id, child;
+  uint32_t idx;
+
+  id = ino->blocks[NDIRECT + l];
+  if (id == 0) {
+    if (!alloc)
+      return 0;
+    memset(zero, 0, sizeof(zero));
+    id = ino->blocks[NDIRECT + l] = bm->alloc_block();
+    pcache_put(id, zero);
+  }
+
+  for (int d = l + 1; d > h; --d) {
+    idx = j / npow(d - 1 - h) % NINDIRECT;
+    pcache_get(id, ptrs);
+    child = ptrs[idx];
+    if (child == 0) {
+      if (!alloc)
+        return 0;
+      memset(zero, 0, sizeof(zero));
+      child = bm->alloc_block();
+      pcache_put(child, zero);
+      ptrs[idx] = child;
+      pcache_put(id, ptrs);
+    }
+    id = child;
+  }
+  return id;
+}
+
+/* Fill ids with the addresses of data blocks [start, start + n)
+ * of ino. Only the pointer blocks covering the range are read;
+ * blocks under a missing pointer block come back as 0. */
+void
+inode_manager::get_blocks(struct inode *ino, int start, int n, blockid_t *ids)
+{
+  int end = start + n, lo, hi, base, m, i, l;
+  uint32_t j;
+  blockid_t ptrs[NINDIRECT], leaf;
+
+  if (ino->flags & I_EXTENTS) {
+    ext_get_blocks(ino, start, n, ids);
+    return;
+  }
+
+  // direct blocks
+  for (i = start; i < MIN(end, NDIRECT); ++i)
+    *ids++ = ino->blocks[i];
+
+  // then leaf pointer blocks of each level in turn
+  for (l = 0; l < NLEVEL; ++l) {
+    base = level_base(l);
+    lo = MAX(start, base);
+    hi = MIN(end, base + (int) npow(l + 1));
+    for (; lo < hi; lo += m) {
+      j = (lo - base) / NINDIRECT;
+      m = MIN(hi - lo, (int) (NINDIRECT - (lo - base) % NINDIRECT));
+      leaf = map_node(ino, l, 1, j, false);
+      if (leaf == 0) {
+        memset(ids, 0, m * sizeof(blockid_t));
+      } else {
+        pcache_get(leaf, ptrs);
+        memcpy(ids, ptrs + (lo - base) % NINDIRECT, m * sizeof(blockid_t));
       }
+      ids += m;
+    }
+  }
+}
+
+/* Make ids the addresses of data blocks [start, start + n) of ino,
+ * allocating pointer blocks on the way. Only the pointer blocks
+ * covering the range are rewritten. */
+void
+inode_manager::set_blocks(struct inode *ino, int start, int n,
+                          const blockid_t *ids)
+{
+  blockid_t ptrs[NINDIRECT], leaf;
+  int end = start + n, lo, hi, base, m, i, l;
+  uint32_t j;
+
+  if (ino->flags & I_EXTENTS) {
+    ext_set_blocks(ino, start, n, ids);
+    return;
+  }
+
+  for (i = start; i < MIN(end, NDIRECT); ++i)
+    ino->blocks[i] = *ids++;
+
+  for (l = 0; l < NLEVEL; ++l) {
+    base = level_base(l);
+    lo = MAX(start, base);
+    hi = MIN(end, base + (int) npow(l + 1));
+    for (; lo < hi; lo += m) {
+      j = (lo - base) / NINDIRECT;
+      m = MIN(hi - lo, (int) (NINDIRECT - (lo - base) % NINDIRECT));
+      leaf = map_node(ino, l, 1, j, true);
+      pcache_get(leaf, ptrs);
+      memcpy(ptrs + (lo - base) % NINDIRECT, ids, m * sizeof(blockid_t));
+      pcache_put(leaf, ptrs);
+      ids += m;
+    }
+  }
+}
+
+/* Free data blocks [n, org_n) of ino, along with the pointer
+ * blocks that no longer map anything, and clear their addresses.
+ * Each level is trimmed bottom-up, so a pointer block is only
+ * freed after everything under it. */
+void
+inode_manager::trunc_blocks(struct inode *ino, int n, int org_n)
+{
+  blockid_t ptrs[NINDIRECT], id;
+  uint32_t kept, had, span, sub, j, c, k;
+  int base, i, l, h;
 
-      if (leftover > 0) {
-        bm->read_block(*(idblocks + (cur_blk - stop)), buf);
-        memcpy(*buf_out + (cur_blk << 9), buf, leftover);
+  if (ino->flags & I_EXTENTS) {
+    ext_trunc_blocks(ino, n);
+    return;
+  }
+
+  for (i = n; i < MIN(org_n, NDIRECT); ++i) {
+    if (ino->blocks[i] != 0)
+      bm->free_block(ino->blocks[i]);
+    ino->blocks[i] = 0;
+  }
+
+  for (l = 0; l < NLEVEL; ++l) {
+    base = level_base(l);
+    kept = MIN((uint32_t) MAX(n - base, 0), npow(l + 1));
+    had = MIN((uint32_t) MAX(org_n - base, 0), npow(l + 1));
+    if (ino->blocks[NDIRECT + l] == 0 || kept >= had)
+      continue;
+
+    for (h = 1; h <= l + 1; ++h) {
+      span = npow(h);     // data blocks under a block at height h
+      sub = npow(h - 1);  // ... and under each of its entries
+      for (j = kept / span; j * span < had; ++j) {
+        id = map_node(ino, l, h, j, false);
+        if (id == 0)
+          continue;
+        // entries from c on no longer map anything
+        c = j * span >= kept ? 0 : (kept - j * span + sub - 1) / sub;
+        pcache_get(id, ptrs);
+        if (h == 1) {
+          for (k = c; k < NINDIRECT; ++k) {
+            if (ptrs[k] != 0)
+              bm->free_block(ptrs[k]);
+          }
+        }
+        if (c == 0) {
+          pcache_free(id);
+          continue;
+        }
+        memset(ptrs + c, 0, (NINDIRECT - c) * sizeof(blockid_t));
+        pcache_put(id, ptrs);
       }
     }
-    else {
-      if (leftover > 0) {
-        bm->read_block(ino->blocks[cur_blk], buf);
-        memcpy(*buf_out + (cur_blk << 9), buf, leftover);
+    if (kept == 0)
+      ino->blocks[NDIRECT + l] = 0;
+  }
+}
+
+// Fill in ids[b - start] for the blocks b in [start, start + n)
+// that the count extents in ex map.
+static void
+fill_extents(const extent_t *ex, int count, int start, int n,
+             blockid_t *ids)
+{
+  int i, b, lo, hi;
+
+  for (i = 0; i < count; ++i) {
+    lo = MAX(start, (int) ex[i].lblk);
+    hi = MIN(start + n, (int) (ex[i].lblk + ex[i].len));
+    for (b = lo; b < hi; ++b)
+      ids[b - start] = ex[i].pblk + (b - ex[i].lblk);
+  }
+}
+
+// Insert e, which must not overlap any extent in ext, keeping ext
+// sorted and merging e with the extents it continues.
+static void
+add_extent(std::vector<extent_t> &ext, extent_t e)
+{
+  std::vector<extent_t>::iterator it = ext.begin();
+
+  while (it != ext.end() && it->lblk < e.lblk)
+    ++it;
+  if (it != ext.begin()) {
+    extent_t &p = *(it - 1);
+    if (p.lblk + p.len == e.lblk && p.pblk + p.len == e.pblk) {
+      p.len += e.len;
+      if (it != ext.end() && e.lblk + e.len == it->lblk &&
+          e.pblk + e.len == it->pblk) {
+        p.len += it->len;
+        ext.erase(it);
       }
+      return;
+    }
+  }
+  if (it != ext.end() && e.lblk + e.len == it->lblk &&
+      e.pblk + e.len == it->pblk) {
+    it->lblk = e.lblk;
+    it->pblk = e.pblk;
+    it->len += e.len;
+    return;
+  }
+  ext.insert(it, e);
+}
+
+/* get_blocks for an extent-mapped inode: only the leaves
+ * overlapping the range are read, and each extent is looked up
+ * once however many blocks it maps. */
+void
+inode_manager::ext_get_blocks(struct inode *ino, int start, int n,
+                              blockid_t *ids)
+{
+  extent_header_t *eh = (extent_header_t *) ino->blocks, *lh;
+  extent_t *ex = (extent_t *) (eh + 1);
+  blockid_t leaf[NINDIRECT];
+  int i;
+
+  memset(ids, 0, n * sizeof(blockid_t));
+  if (eh->depth == 0) {
+    fill_extents(ex, eh->count, start, n, ids);
+    return;
+  }
+
+  // leaf i maps [ex[i].lblk, ex[i + 1].lblk)
+  for (i = 0; i < eh->count && (int) ex[i].lblk < start + n; ++i) {
+    if (i + 1 < eh->count && (int) ex[i + 1].lblk <= start)
+      continue;
+    pcache_get(ex[i].pblk, leaf);
+    lh = (extent_header_t *) leaf;
+    fill_extents((extent_t *) (lh + 1), lh->count, start, n, ids);
+  }
+}
+
+/* set_blocks for an extent-mapped inode. The range must be a hole;
+ * each physically contiguous run in ids becomes one extent. */
+void
+inode_manager::ext_set_blocks(struct inode *ino, int start, int n,
+                              const blockid_t *ids)
+{
+  std::vector<extent_t> ext;
+  extent_t e;
+  int i, j;
+
+  load_extents(ino, ext);
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && ids[j] == ids[j - 1] + 1; ++j)
+      ;
+    if (ids[i] == 0)
+      continue;
+    e.lblk = start + i;
+    e.pblk = ids[i];
+    e.len = j - i;
+    add_extent(ext, e);
+  }
+  store_extents(ino, ext);
+}
+
+/* trunc_blocks for an extent-mapped inode: drop or cut the extents
+ * reaching past block n and free what they mapped. */
+void
+inode_manager::ext_trunc_blocks(struct inode *ino, int n)
+{
+  std::vector<extent_t> ext;
+  uint32_t keep, k;
+  size_t i;
+
+  load_extents(ino, ext);
+  for (i = 0; i < ext.size(); ++i) {
+    extent_t &e = ext[i];
+    keep = (int) e.lblk >= n ? 0 : MIN(e.len, n - e.lblk);
+    for (k = keep; k < e.len; ++k)
+      bm->free_block(e.pblk + k);
+    e.len = keep;
+  }
+  while (!ext.empty() && ext.back().len == 0)
+    ext.pop_back();
+  store_extents(ino, ext);
+}
+
+/* Read all the extents of ino into ext. */
+void
+inode_manager::load_extents(struct inode *ino, std::vector<extent_t> &ext)
+{
+  extent_header_t *eh = (extent_header_t *) ino->blocks, *lh;
+  extent_t *ex = (extent_t *) (eh + 1);
+  blockid_t leaf[NINDIRECT];
+  int i;
+
+  if (eh->depth == 0) {
+    ext.assign(ex, ex + eh->count);
+    return;
+  }
+  for (i = 0; i < eh->count; ++i) {
+    pcache_get(ex[i].pblk, leaf);
+    lh = (extent_header_t *) leaf;
+    ext.insert(ext.end(), (extent_t *) (lh + 1),
+               (extent_t *) (lh + 1) + lh->count);
+  }
+}
+
+/* Make ext the extents of ino: inline if they fit, otherwise in leaf
+ * blocks of which only those whose contents change are written. An
+ * inode with more extents than the leaves can index is converted to
+ * a block map. */
+void
+inode_manager::store_extents(struct inode *ino,
+                             const std::vector<extent_t> &ext)
+{
+  extent_header_t *eh = (extent_header_t *) ino->blocks;
+  extent_t *ex = (extent_t *) (eh + 1);
+  std::vector<blockid_t> leaves, ids;
+  blockid_t buf[NINDIRECT], old[NINDIRECT], id;
+  extent_header_t *lh = (extent_header_t *) buf;
+  size_t nleaf, i, n;
+
+  if (eh->depth == 1) {
+    for (i = 0; i < eh->count; ++i)
+      leaves.push_back(ex[i].pblk);
+  }
+  nleaf = 0;
+  if (ext.size() > NEXTENT_INODE)
+    nleaf = (ext.size() + NEXTENT_LEAF - 1) / NEXTENT_LEAF;
+  if (nleaf > NEXTENT_INODE)
+    nleaf = 0;
+  for (i = nleaf; i < leaves.size(); ++i)
+    pcache_free(leaves[i]);
+  memset(ino->blocks, 0, sizeof(ino->blocks));
+
+  if (ext.size() > NEXTENT_INODE * NEXTENT_LEAF) {
+    ino->flags &= ~I_EXTENTS;
+    for (i = 0; i < ext.size(); ++i) {
+      ids.resize(ext[i].len);
+      for (n = 0; n < ext[i].len; ++n)
+        ids[n] = ext[i].pblk + n;
+      set_blocks(ino, ext[i].lblk, ext[i].len, ids.data());
+    }
+    return;
+  }
+
+  if (nleaf == 0) {
+    eh->count = ext.size();
+    memcpy(ex, ext.data(), ext.size() * sizeof(extent_t));
+    return;
+  }
+
+  eh->depth = 1;
+  eh->count = nleaf;
+  for (i = 0; i < nleaf; ++i) {
+    n = MIN(NEXTENT_LEAF, ext.size() - i * NEXTENT_LEAF);
+    memset(buf, 0, sizeof(buf));
+    lh->count = n;
+    memcpy(lh + 1, &ext[i * NEXTENT_LEAF], n * sizeof(extent_t));
+    if (i < leaves.size()) {
+      id = leaves[i];
+      pcache_get(id, old);
+      if (memcmp(old, buf, BLOCK_SIZE) != 0)
+        pcache_put(id, buf);
+    } else {
+      id = bm->alloc_block();
+      pcache_put(id, buf);
+    }
+    ex[i].lblk = ext[i * NEXTENT_LEAF].lblk;
+    ex[i].pblk = id;
+    ex[i].len = n;
+  }
+}
+
+// Whether the data in v is all zeros, in which case a hole can
+// stand in for its block.
+static bool
+zero_data(const struct iovec *v)
+{
+  const char *p = (const char *) v->iov_base;
+  size_t i;
+
+  for (i = 0; i < v->iov_len; ++i) {
+    if (p[i] != 0)
+      return false;
+  }
+  return true;
+}
+
+/* Allocate blocks for the holes among data blocks [start, start + n)
+ * of ino, whose addresses are in ids, and fill them into ids. Holes
+ * that would be written all zeros from iov are left as they are.
+ * Each run of holes is filled by extents that continue the block
+ * before it. */
+void
+inode_manager::alloc_blocks(struct inode *ino, int start, int n,
+                            blockid_t *ids, const struct iovec *iov)
+{
+  blockid_t prev = 0, b;
+  uint32_t len;
+  int i, j, k;
+
+  if (n > 0 && ids[0] == 0 && start > 0)
+    get_blocks(ino, start - 1, 1, &prev);
+  for (i = 0; i < n; i = j) {
+    j = i + 1;
+    if (ids[i] != 0) {
+      prev = ids[i];
+      continue;
+    }
+    if (zero_data(&iov[i]))
+      continue;
+    while (j < n && ids[j] == 0 && !zero_data(&iov[j]))
+      ++j;
+    for (k = i; k < j; k += len) {
+      b = bm->alloc_extent(j - k, prev ? prev + 1 : 0, len);
+      for (uint32_t m = 0; m < len; ++m)
+        ids[k + m] = b + m;
+      prev = b + len - 1;
     }
+    set_blocks(ino, start + i, j - i, ids + i);
+  }
+}
+
+/* Write iov to data blocks ids as write_blocks does, skipping the
+ * holes alloc_blocks left. Both arrays are used as scratch space. */
+void
+inode_manager::write_data(blockid_t *ids, int n, struct iovec *iov)
+{
+  int i, m = 0;
+
+  for (i = 0; i < n; ++i) {
+    if (ids[i] == 0)
+      continue;
+    ids[m] = ids[i];
+    iov[m++] = iov[i];
+  }
+  bm->write_blocks(ids, m, iov);
+}
+
+/* Move the inline data of ino out to a data block, so it can grow
+ * past INLINE_MAX bytes. */
+void
+inode_manager::uninline(struct inode *ino)
+{
+  char buf[BLOCK_SIZE];
+  blockid_t id = 0;
+  struct iovec v;
+
+  memcpy(buf, ino->blocks, ino->size);
+  memset(ino->blocks, 0, sizeof(ino->blocks));
+  ino->flags &= ~I_INLINE;
+
+  v.iov_base = buf;
+  v.iov_len = ino->size;
+  alloc_blocks(ino, 0, 1, &id, &v);
+  write_data(&id, 1, &v);
+}
+
+/* Read data blocks ids into iov as read_blocks does, except that
+ * holes are zero-filled without touching the disk. Both arrays are
+ * used as scratch space. */
+void
+inode_manager::read_data(blockid_t *ids, int n, struct iovec *iov)
+{
+  int i, m = 0;
+
+  for (i = 0; i < n; ++i) {
+    if (ids[i] == 0) {
+      memset(iov[i].iov_base, 0, iov[i].iov_len);
+      continue;
+    }
+    ids[m] = ids[i];
+    iov[m++] = iov[i];
+  }
+  bm->read_blocks(ids, m, iov);
+}
+
+/* Get all the data of a file by inum. 
+ * Return alloced data, should be freed by caller. */
+void
+inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
+{
+  /*
+   * your code goes here.
+   * note: read blocks related to inode number inum,
+   * and copy them to buf_out
+   */
+  std::vector<blockid_t> ids;
+  std::vector<struct iovec> iov;
+  unsigned int fsize;
+  int nblk, i;
+  inode_t *ino = get_inode(inum);
+
+  if (ino == NULL) {
+    printf("\tim: file for read not exist\n");
+    return;
+  }
+
+  fsize = ino->size;
+  if (fsize == 0)
+    *buf_out = NULL;
+  else if (ino->flags & I_INLINE) {
+    *buf_out = (char *) malloc(fsize);
+    memcpy(*buf_out, ino->blocks, fsize);
+  } else {
+    *buf_out = (char *) malloc(fsize);
+    nblk = (fsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    // read straight into the caller's buffer
+    ids.resize(nblk);
+    iov.resize(nblk);
+    get_blocks(ino, 0, nblk, ids.data());
+    for (i = 0; i < nblk; ++i) {
+      iov[i].iov_base = *buf_out + i * BLOCK_SIZE;
+      iov[i].iov_len = MIN(BLOCK_SIZE, fsize - i * BLOCK_SIZE);
+    }
+    read_data(ids.data(), nblk, iov.data());
   }
 
   *size = fsize;
-  ino->atime = (unsigned int) time(NULL);
-  put_inode(inum, ino);
-  free(ino);
+  touch_atime(inum, ino);
+  release_inode(ino);
 }
 
-/* alloc/free blocks if needed */
-// Consider all situations with regard to the value
-// of nblk, org_blk, NDIRECT and offset
+/* Read up to len bytes at offset off of a file by inum.
+ * Only the blocks overlapping the range are read.
+ * Return alloced data, should be freed by caller. */
 void
+inode_manager::read_range(uint32_t inum, unsigned int off, unsigned int len,
+                          char **buf_out, int *size)
+{
+  std::vector<blockid_t> ids;
+  std::vector<struct iovec> iov;
+  char buf[BLOCK_SIZE];
+  unsigned int end, pos;
+  int first, nblk, i;
+  inode_t *ino = get_inode(inum);
+
+  *buf_out = NULL;
+  *size = 0;
+  if (ino == NULL) {
+    printf("\tim: file for read not exist\n");
+    return;
+  }
+
+  if (off >= ino->size || len == 0)
+    goto out;
+
+  end = off + MIN(len, ino->size - off);
+  first = off / BLOCK_SIZE;
+  nblk = (end - 1) / BLOCK_SIZE - first + 1;
+  *buf_out = (char *) malloc(end - off);
+  *size = end - off;
+  if (ino->flags & I_INLINE) {
+    memcpy(*buf_out, (char *) ino->blocks + off, end - off);
+    goto out;
+  }
+
+  ids.resize(nblk);
+  iov.resize(nblk);
+  get_blocks(ino, first, nblk, ids.data());
+
+  // a block the range starts inside of goes through a bounce buffer,
+  // the rest are read straight into the caller's buffer
+  pos = off;
+  i = 0;
+  if (off % BLOCK_SIZE != 0) {
+    if (ids[0] != 0)
+      bm->read_block(ids[0], buf);
+    else
+      memset(buf, 0, BLOCK_SIZE);
+    memcpy(*buf_out, buf + off % BLOCK_SIZE,
+           MIN(BLOCK_SIZE - off % BLOCK_SIZE, end - off));
+    pos = (first + 1) * BLOCK_SIZE;
+    i = 1;
+  }
+  for (int k = i; k < nblk; ++k, pos += BLOCK_SIZE) {
+    iov[k].iov_base = *buf_out + (pos - off);
+    iov[k].iov_len = MIN(BLOCK_SIZE, end - pos);
+  }
+  read_data(ids.data() + i, nblk - i, iov.data() + i);
+
+out:
+  touch_atime(inum, ino);
+  release_inode(ino);
+}
+
+/* alloc/free blocks if needed */
+extent_protocol::status
 inode_manager::write_file(uint32_t inum, const char *buf, int size)
 {
   /*
@@ -433,146 +1702,237 @@ inode_manager::write_file(uint32_t inum, const char *buf, int size)
    * you need to consider the situation when the size of buf 
    * is larger or smaller than the size of original inode
    */
-  char buf_in[BLOCK_SIZE];
-  unsigned int fsize;
-  inode_t *ino = get_inode(inum);
-  char idrct_blocks[BLOCK_SIZE];
-  blockid_t *idblocks, new_blk;
-  int nblk, org_nblk, offset, cur_blk, stop;
+  std::vector<blockid_t> ids;
+  std::vector<struct iovec> iov;
+  int nblk, org_nblk, i;
+  inode_t *ino;
 
-  if (size > static_cast<int>(MAXFILE * BLOCK_SIZE)) {
+  if (size < 0 || size > static_cast<int>(MAXFILE * BLOCK_SIZE)) {
     printf("\tim: file to write exceeds size limit\n");
-    exit(1);
+    return extent_protocol::IOERR;
   }
+  ino = get_inode(inum);
   if (ino == NULL) {
     printf("\tim: file not exist\n");
-    return;
+    return extent_protocol::NOENT;
   }
 
-  fsize = ino->size;
-  idblocks = (blockid_t *) idrct_blocks;
-  nblk = size / BLOCK_SIZE;
-  offset = size % BLOCK_SIZE;
-  org_nblk = fsize / BLOCK_SIZE;
-  if (fsize % BLOCK_SIZE > 0)
-    ++org_nblk;
-  stop = MIN(org_nblk, nblk);
-  stop = MIN(stop, NDIRECT);
-
-  for (cur_blk = 0; cur_blk < stop; ++cur_blk) {
-    // specified to BLOCK_SIZE
-    memcpy(buf_in, buf + (cur_blk << 9), BLOCK_SIZE);
-    bm->write_block(ino->blocks[cur_blk], buf_in);
-  }
-
-  if (stop == nblk && stop < org_nblk && stop < NDIRECT) {
-    if (offset > 0) {
-      memcpy(buf_in, buf + (cur_blk << 9), offset);
-      bm->write_block(ino->blocks[cur_blk], buf_in);
-      ++cur_blk;
-    }
+  nblk = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  org_nblk = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (ino->flags & I_INLINE) {
+    memset(ino->blocks, 0, sizeof(ino->blocks));
+    ino->flags &= ~I_INLINE;
+    org_nblk = 0;
   }
-  else if (stop == NDIRECT && stop < org_nblk) {
-    bm->read_block(ino->blocks[cur_blk], idrct_blocks);
-    stop = MIN(nblk, org_nblk);
 
-    for (; cur_blk < stop; ++cur_blk) {
-      memcpy(buf_in, buf + (cur_blk << 9), BLOCK_SIZE);
-      bm->write_block(*(idblocks + (cur_blk - NDIRECT)), buf_in);
-    }
-    
-    if (stop < org_nblk) {
-      if (offset > 0) {
-        memcpy(buf_in, buf + (cur_blk << 9), offset);
-        bm->write_block(*(idblocks + (cur_blk - NDIRECT)), buf_in);
-        ++cur_blk;
-      }
-    }
-    else if (offset > 0 || nblk > org_nblk) {
-      for (; cur_blk < nblk; ++cur_blk) {
-        new_blk = bm->alloc_block();
-        memcpy(buf_in, buf + (cur_blk << 9), BLOCK_SIZE);
-        bm->write_block(new_blk, buf_in);
-        *(idblocks + (cur_blk - NDIRECT)) = new_blk;
-      }
-      if (offset > 0) {
-        new_blk = bm->alloc_block();
-        memcpy(buf_in, buf + (cur_blk << 9), offset);
-        bm->write_block(new_blk, buf_in);
-        *(idblocks + (cur_blk - NDIRECT)) = new_blk;
-        ++cur_blk;
-      }
+  // small files live in the inode itself
+  if ((unsigned int) size <= INLINE_MAX) {
+    trunc_blocks(ino, 0, org_nblk);
+    memset(ino->blocks, 0, sizeof(ino->blocks));
+    memcpy(ino->blocks, buf, size);
+    ino->flags |= I_INLINE;
+    goto out;
+  }
 
-      bm->write_block(ino->blocks[NDIRECT], idrct_blocks);
-    }
+  trunc_blocks(ino, nblk, org_nblk);
+  ids.resize(nblk);
+  iov.resize(nblk);
+  get_blocks(ino, 0, nblk, ids.data());
+  for (i = 0; i < nblk; ++i) {
+    iov[i].iov_base = (char *) buf + i * BLOCK_SIZE;
+    iov[i].iov_len = MIN(BLOCK_SIZE, size - i * BLOCK_SIZE);
   }
-  else if (stop == org_nblk) {
-    stop = MIN(nblk, NDIRECT);
+  alloc_blocks(ino, 0, nblk, ids.data(), iov.data());
+  write_data(ids.data(), nblk, iov.data());
 
-    for (; cur_blk < stop; ++cur_blk) {
-      new_blk = bm->alloc_block();
-      memcpy(buf_in, buf + (cur_blk << 9), BLOCK_SIZE);
-      bm->write_block(new_blk, buf_in);
-      ino->blocks[cur_blk] = new_blk;
-    }
+out:
+  ino->size = size;
+  ino->atime = (unsigned int) time(NULL);
+  ino->mtime = (unsigned int) time(NULL);
+  put_inode(inum, ino);
+  release_inode(ino);
+  return extent_protocol::OK;
+}
 
-    if (stop == nblk && stop < NDIRECT) {
-      if (offset > 0) {
-        new_blk = bm->alloc_block();
-        memcpy(buf_in, buf + (cur_blk << 9), offset);
-        bm->write_block(new_blk, buf_in);
-        ino->blocks[cur_blk] = new_blk;
-        ++cur_blk;
-      }
+/* Write len bytes of buf at offset off of a file by inum, extending
+ * it if needed. Only the blocks overlapping the range are written and
+ * only holes and blocks past the old end of file are allocated; a
+ * block the range covers part of is read, patched and written back.
+ * The file's mtime and ctime are set to mtime, or to now if it is 0. */
+extent_protocol::status
+inode_manager::write_range(uint32_t inum, unsigned int off,
+                           const char *buf, unsigned int len,
+                           unsigned int mtime)
+{
+  std::vector<blockid_t> ids;
+  std::vector<struct iovec> iov;
+  char bounce[2][BLOCK_SIZE];
+  unsigned int end, size, pos, boff, bend;
+  int first, last, nb, i;
+  inode_t *ino;
+
+  end = off + len;
+  if (end < off || end > MAXFILE * BLOCK_SIZE) {
+    printf("\tim: file to write exceeds size limit\n");
+    return extent_protocol::IOERR;
+  }
+  ino = get_inode(inum);
+  if (ino == NULL) {
+    printf("\tim: file not exist\n");
+    return extent_protocol::NOENT;
+  }
+
+  if (len == 0)
+    goto out;
+  size = MAX(ino->size, end);
+  if (ino->size == 0 || (ino->flags & I_INLINE)) {
+    if (size <= INLINE_MAX) {
+      memcpy((char *) ino->blocks + off, buf, len);
+      ino->flags |= I_INLINE;
+      goto done;
     }
-    else if (offset > 0 || nblk > NDIRECT) {
-      ino->blocks[NDIRECT] = bm->alloc_block();
-
-      for (; cur_blk < nblk; ++cur_blk) {
-        new_blk = bm->alloc_block();
-        memcpy(buf_in, buf + (cur_blk << 9), BLOCK_SIZE);
-        bm->write_block(new_blk, buf_in);
-        *(idblocks + (cur_blk - NDIRECT)) = new_blk;
-      }
-      if (offset > 0) {
-        new_blk = bm->alloc_block();
-        memcpy(buf_in, buf + (cur_blk << 9), offset);
-        bm->write_block(new_blk, buf_in);
-        *(idblocks + (cur_blk - NDIRECT)) = new_blk;
-        ++cur_blk;
-      }
+    if (ino->flags & I_INLINE)
+      uninline(ino);
+  }
 
-      bm->write_block(ino->blocks[NDIRECT], idrct_blocks);
+  first = off / BLOCK_SIZE;
+  last = (end - 1) / BLOCK_SIZE;
+  ids.resize(last - first + 1);
+  iov.resize(last - first + 1);
+  get_blocks(ino, first, last - first + 1, ids.data());
+
+  nb = 0;
+  for (i = first; i <= last; ++i) {
+    struct iovec &v = iov[i - first];
+    pos = i * BLOCK_SIZE;
+    boff = MAX(off, pos) - pos;
+    bend = MIN(end, pos + BLOCK_SIZE) - pos;
+    if (boff == 0 && (bend == BLOCK_SIZE || pos + bend >= ino->size)) {
+      // the rest of the block is past the end of file and stays zero
+      v.iov_base = (char *) buf + (pos - off);
+      v.iov_len = bend;
+    } else {
+      char *b = bounce[nb++];
+      if (ids[i - first] != 0)
+        bm->read_block(ids[i - first], b);
+      else
+        memset(b, 0, BLOCK_SIZE);
+      memcpy(b + boff, buf + (pos + boff - off), bend - boff);
+      v.iov_base = b;
+      v.iov_len = BLOCK_SIZE;
     }
   }
+  alloc_blocks(ino, first, last - first + 1, ids.data(), iov.data());
+  write_data(ids.data(), last - first + 1, iov.data());
 
-  // finish write file
-  // start to free block
-  if (org_nblk > cur_blk) {
-    stop = MIN(org_nblk, NDIRECT);
+done:
+  ino->size = size;
+  ino->mtime = mtime ? mtime : (unsigned int) time(NULL);
+  ino->ctime = ino->mtime;
+  put_inode(inum, ino);
+out:
+  release_inode(ino);
+  return extent_protocol::OK;
+}
 
-    for (; cur_blk < stop; ++cur_blk)
-      bm->free_block(ino->blocks[cur_blk]);
-    if (cur_blk < org_nblk) {
-      if (cur_blk > NDIRECT) {
-        for (; cur_blk < org_nblk; ++cur_blk)
-          bm->free_block(*(idblocks + (cur_blk - NDIRECT)));
-        bm->write_block(ino->blocks[NDIRECT], idrct_blocks);
-      }
-      else {
-        bm->read_block(ino->blocks[NDIRECT], idrct_blocks);
-        for (; cur_blk < org_nblk; ++cur_blk)
-          bm->free_block(*(idblocks + (cur_blk - NDIRECT)));
-        bm->free_block(ino->blocks[NDIRECT]);
+/* Set the size of a file by inum. Shrinking frees the blocks past
+ * the new end and clears the rest of the last block; growing only
+ * changes the size, leaving a hole that reads as zeros. */
+extent_protocol::status
+inode_manager::truncate(uint32_t inum, unsigned int size)
+{
+  char buf[BLOCK_SIZE];
+  blockid_t id;
+  int nblk, org_nblk;
+  inode_t *ino;
+
+  if (size > MAXFILE * BLOCK_SIZE) {
+    printf("\tim: file to truncate exceeds size limit\n");
+    return extent_protocol::IOERR;
+  }
+  ino = get_inode(inum);
+  if (ino == NULL) {
+    printf("\tim: file not exist\n");
+    return extent_protocol::NOENT;
+  }
+
+  if (ino->flags & I_INLINE) {
+    if (size <= INLINE_MAX) {
+      if (size < ino->size)
+        memset((char *) ino->blocks + size, 0, ino->size - size);
+      goto out;
+    }
+    uninline(ino);
+  }
+
+  if (size < ino->size) {
+    nblk = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    org_nblk = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    trunc_blocks(ino, nblk, org_nblk);
+    if (size % BLOCK_SIZE != 0) {
+      get_blocks(ino, nblk - 1, 1, &id);
+      if (id != 0) {
+        bm->read_block(id, buf);
+        memset(buf + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+        bm->write_block(id, buf);
       }
     }
   }
 
+out:
   ino->size = size;
-  ino->atime = (unsigned int) time(NULL);
   ino->mtime = (unsigned int) time(NULL);
+  ino->ctime = ino->mtime;
   put_inode(inum, ino);
-  free(ino);
+  release_inode(ino);
+  return extent_protocol::OK;
+}
+
+/* Find the first offset at or after off of a file by inum that is
+ * in data (SEEK_DATA) or in a hole (SEEK_HOLE), as lseek(2) does.
+ * The end of file counts as a hole. Return NOENT if there is none. */
+extent_protocol::status
+inode_manager::seek(uint32_t inum, unsigned int off, int whence,
+                    unsigned int &pos)
+{
+  blockid_t ids[NINDIRECT];
+  extent_protocol::status r = extent_protocol::NOENT;
+  int i, k, n, nblk;
+  inode_t *ino = get_inode(inum);
+
+  if (ino == NULL) {
+    printf("\tim: file not exist\n");
+    return extent_protocol::NOENT;
+  }
+  if (off >= ino->size)
+    goto out;
+  if (ino->flags & I_INLINE) {
+    pos = whence == SEEK_DATA ? off : ino->size;
+    r = extent_protocol::OK;
+    goto out;
+  }
+
+  // scan the block map a pointer block's worth at a time
+  nblk = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for (i = off / BLOCK_SIZE; i < nblk; i += n) {
+    n = MIN(nblk - i, (int) NINDIRECT);
+    get_blocks(ino, i, n, ids);
+    for (k = 0; k < n; ++k) {
+      if ((ids[k] != 0) == (whence == SEEK_DATA)) {
+        pos = MAX(off, (unsigned int) (i + k) * BLOCK_SIZE);
+        r = extent_protocol::OK;
+        goto out;
+      }
+    }
+  }
+  if (whence == SEEK_HOLE) {
+    pos = ino->size;
+    r = extent_protocol::OK;
+  }
+
+out:
+  release_inode(ino);
+  return r;
 }
 
 void
@@ -593,7 +1953,17 @@ inode_manager::getattr(uint32_t inum, extent_protocol::attr &a)
   a.ctime = ino->ctime;
   a.size = ino->size;
 
-  free(ino);
+  release_inode(ino);
+}
+
+// Totals for statfs, from the counts kept in the superblock.
+void
+inode_manager::statfs(extent_protocol::fsstat &s)
+{
+  s.bsize = BLOCK_SIZE;
+  s.blocks = bm->sb.nblocks - FDBLOCK(bm->sb.nblocks);
+  s.files = bm->sb.ninodes - 1;
+  bm->statfs(s.bfree, s.ffree);
 }
 
 void
@@ -604,8 +1974,7 @@ inode_manager::remove_file(uint32_t inum)
    * note: you need to consider about both the data block and inode of the file
    */
   inode_t *ino;
-  int nblk, offset, fsize;
-  int cur_blk, stop;
+  int nblk;
 
   ino = get_inode(inum);
   if (ino == NULL) {
@@ -613,26 +1982,10 @@ inode_manager::remove_file(uint32_t inum)
     return;
   }
 
-  fsize = ino->size;
-  nblk = fsize / BLOCK_SIZE;
-  offset = fsize % BLOCK_SIZE;
-  if (offset > 0)
-    ++nblk;
-
-  stop = MIN(nblk, NDIRECT);
-  for (cur_blk = 0; cur_blk < stop; ++cur_blk)
-    bm->free_block(ino->blocks[cur_blk]);
-  if (stop < nblk) {
-    char idrct_blocks[BLOCK_SIZE];
-    blockid_t *idblocks;
-    idblocks = (blockid_t *) idrct_blocks;
-
-    bm->read_block(ino->blocks[NDIRECT], idrct_blocks);
-    for (; cur_blk < nblk; ++cur_blk)
-      bm->free_block(*(idblocks + (cur_blk - NDIRECT)));
-    bm->free_block(ino->blocks[NDIRECT]);
-  }
+  nblk = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (!(ino->flags & I_INLINE))
+    trunc_blocks(ino, 0, nblk);
 
   free_inode(inum);
-  free(ino);
+  release_inode(ino);
 }
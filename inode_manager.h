@@ -4,6 +4,12 @@
 #define inode_h
 
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <vector>
+#include <map>
+#include <set>
 #include "extent_protocol.h" // TODO: delete it
 
 #define DISK_SIZE  1024*1024*16
@@ -14,46 +20,112 @@ typedef uint32_t blockid_t;
 
 // disk layer -----------------------------------------
 
+#define CHFS_MAGIC 0x63686673  // "chfs"
+#define CHFS_VERSION 4         // on-disk format version
+
+// free_blocks and free_inodes are kept up to date as blocks and
+// inodes are allocated and freed, so statfs need not scan the
+// bitmaps. They are written back along with the block bitmap.
+typedef struct superblock {
+  uint32_t magic;
+  uint32_t size;
+  uint32_t nblocks;
+  uint32_t ninodes;
+  uint32_t version;
+  uint32_t free_blocks;
+  uint32_t free_inodes;
+} superblock_t;
+
+// The disk is a mapping of an image file named by $CHFS_DISK_IMAGE,
+// or an anonymous (volatile) mapping when it is unset. A new image
+// is created with $CHFS_DISK_SIZE bytes (default DISK_SIZE), which
+// must fit the 32-bit size in the superblock; an existing one is
+// mapped with the size recorded there, and refused if that does not
+// match its block count.
+// Dirty blocks are msync'ed every $CHFS_DISK_SYNC writes, or only
+// on sync() if it is 0.
 class disk {
  private:
-  unsigned char blocks[BLOCK_NUM][BLOCK_SIZE];
+  unsigned char *blocks;
+  uint32_t nblocks;
+  int fd;
+  uint32_t sync_every;
+  uint32_t nwrites;
+  uint32_t dirty_lo, dirty_hi;
+  pthread_mutex_t m;  // protects the dirty range and nwrites
+
+  void map(size_t size);
 
  public:
   disk();
+  ~disk();
+  uint32_t size() { return nblocks; }
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_blocks(const blockid_t *ids, int n, const struct iovec *dst);
+  void write_blocks(const blockid_t *ids, int n, const struct iovec *src);
+  void sync();
 };
 
 // block layer -----------------------------------------
 
-typedef struct superblock {
-  uint32_t size;
-  uint32_t nblocks;
-  uint32_t ninodes;
-} superblock_t;
-
 class block_manager {
  private:
   disk *d;
-  std::map <uint32_t, int> using_blocks;
+  blockid_t next_free;  // next-fit cursor for alloc_block
+
+  // In-memory copy of the block bitmap, which is what allocation
+  // works on. Changed bitmap blocks are written back in batches.
+  char *bitmap;
+  std::vector<bool> bitmap_dirty;
+  uint32_t bitmap_changes;
+  pthread_mutex_t bitmap_m;  // protects the bitmap, next_free and sb
+
+  // Free extents of the bitmap (start -> length), and the same
+  // extents ordered by length for best-fit allocation. mark_blocks
+  // only notes which bitmap blocks changed, in index_stale;
+  // alloc_extent brings the index up to date for those first.
+  std::map <blockid_t, uint32_t> free_extents;
+  std::set <std::pair<uint32_t, blockid_t> > free_by_len;
+  std::vector<bool> index_stale;
+  bool index_changed;  // some of index_stale is set
+
+  void index_range(blockid_t lo, blockid_t hi);
+  void refresh_free_extents();
+  void mark_blocks(blockid_t start, uint32_t len, bool used);
+  void flush_bitmap();
  public:
   block_manager();
   ~block_manager();
   struct superblock sb;
 
   uint32_t alloc_block();
+  blockid_t alloc_extent(uint32_t count, blockid_t hint, uint32_t &len);
   void free_block(uint32_t id);
+  void count_inodes(int delta);
+  void statfs(uint32_t &free_blocks, uint32_t &free_inodes);
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_blocks(const blockid_t *ids, int n, const struct iovec *dst);
+  void write_blocks(const blockid_t *ids, int n, const struct iovec *src);
+  void sync();
 };
 
 // inode layer -----------------------------------------
+//
+// inode_manager is safe to call from several threads as long as no
+// two of them work on the same inode at once unless both only read
+// it; callers serialize that with a lock per inode. The inode and
+// pointer block caches, the inode bitmap and the block allocator
+// each have a lock of their own, held only briefly.
 
 #define INODE_NUM  1024
 
+// On-disk size of an inode, which is packed IPB to a block.
+#define INODE_SIZE    256
+
 // Inodes per block.
-#define IPB           1
-//(BLOCK_SIZE / sizeof(struct inode))
+#define IPB           (BLOCK_SIZE / INODE_SIZE)
 
 // Block containing inode i
 #define IBLOCK(i, nblocks)     ((nblocks)/BPB + (i)/IPB + 3)
@@ -64,34 +136,168 @@ class block_manager {
 // Block containing bit for block b
 #define BBLOCK(b) ((b)/BPB + 2)
 
-#define NDIRECT 100
+// blocks[NDIRECT + l] is the root of a tree of pointer blocks l + 1
+// levels deep: the indirect, double- and triple-indirect blocks.
+// A block address of 0 is a hole, which reads as zeros; so is one
+// under a missing pointer block.
+#define NDIRECT 56
+#define NLEVEL 3
 #define NINDIRECT (BLOCK_SIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define NTINDIRECT (NDINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT)
+
+// inode flags
+#define I_EXTENTS  0x1   // blocks[] holds an extent tree, not a block map
+#define I_INLINE   0x2   // blocks[] holds the data itself
 
 typedef struct inode {
   short type;
+  unsigned short flags;
   unsigned int size;
   unsigned int atime;
   unsigned int mtime;
   unsigned int ctime;
-  blockid_t blocks[NDIRECT+1];   // Data block addresses
+  blockid_t blocks[NDIRECT+NLEVEL];   // Data block addresses
 } inode_t;
 
+static_assert(sizeof(inode_t) <= INODE_SIZE, "inode does not fit its slot");
+
+// Files of up to INLINE_MAX bytes, including small directories, are
+// kept in blocks[] (I_INLINE) and moved out to a data block once they
+// grow past it. I_EXTENTS then still says how that block is mapped.
+#define INLINE_MAX  sizeof(((inode_t *) 0)->blocks)
+
+// An extent-mapped inode (I_EXTENTS) keeps an extent_header and its
+// extents sorted by lblk in blocks[] instead. At depth 0 they are the
+// extents of the file. At depth 1 each one indexes a leaf block, whose
+// header is followed by up to NEXTENT_LEAF extents: lblk is the first
+// block the leaf maps, pblk the leaf block and len its extent count.
+// A file that outgrows that is converted back to a block map.
+// Which of the two a new inode starts with is chosen when it is
+// allocated, per inode.
+typedef struct extent_header {
+  uint16_t depth;
+  uint16_t count;
+} extent_header_t;
+
+typedef struct extent {
+  uint32_t lblk;     // first file block
+  blockid_t pblk;    // first disk block
+  uint32_t len;      // in blocks
+} extent_t;
+
+#define NEXTENT_INODE \
+  ((sizeof(((inode_t *) 0)->blocks) - sizeof(extent_header_t)) / sizeof(extent_t))
+#define NEXTENT_LEAF \
+  ((BLOCK_SIZE - sizeof(extent_header_t)) / sizeof(extent_t))
+
+// Inode cache: an open-addressed table of ICACHE_SIZE entries in
+// which inode i lives in one of the ICACHE_PROBE slots following its
+// hash. Entries are evicted CLOCK-style within that window, and
+// dirty ones are written back on eviction, on sync(), or once they
+// have been dirty for DIRTY_EXPIRE seconds, which a thread checks
+// once a second. Timestamps changed under lazytime wait
+// LAZYTIME_EXPIRE seconds instead. An inode whose
+// window is all pinned gets an overflow entry outside the table,
+// which is written back and dropped once it is unpinned.
+//
+// The holder of an inode's lock changes the cached inode in place,
+// so write-back uses the copy taken by the last put_inode instead.
+#define ICACHE_BITS   8
+#define ICACHE_SIZE   (1 << ICACHE_BITS)
+#define ICACHE_PROBE  8
+
+// Pointer blocks are cached, direct-mapped on their address, so a
+// walk down the block map does not re-read the upper levels.
+#define PCACHE_SIZE   64
+
+#define DIRTY_EXPIRE     30
+#define LAZYTIME_EXPIRE  (24 * 3600)
+
 class inode_manager {
  private:
   block_manager *bm;
+
+  struct icache_entry {
+    uint32_t inum;    // 0 if the slot is empty
+    int pins;         // references handed out by get_inode
+    bool dirty;
+    bool lazy;        // only timestamps changed, under lazytime
+    bool referenced;  // CLOCK bit
+    bool overflow;    // not in the table
+    time_t dirtied;   // when it became dirty or lazy
+    inode_t ino;
+    inode_t saved;    // as of the last put_inode, which is written back
+  };
+  icache_entry icache[ICACHE_SIZE];
+  std::vector<icache_entry *> overflow;
+  pthread_mutex_t icache_m;  // protects icache, overflow and stopping
+
+  struct pcache_entry {
+    blockid_t id;     // 0 if the slot is empty
+    blockid_t ptrs[NINDIRECT];
+  };
+  pcache_entry pcache[PCACHE_SIZE];
+  pthread_mutex_t pcache_m;
+  pthread_mutex_t ialloc_m;  // protects the free inode bitmap
+  bool stopping;
+  pthread_cond_t expire_cond;
+  pthread_t expire_th;
+  int atime_policy;
+
+  icache_entry *icache_lookup(uint32_t inum);
+  icache_entry *icache_victim(uint32_t inum, bool evict);
+  icache_entry *icache_slot(uint32_t inum);
+  void icache_drop(icache_entry *e);
+  icache_entry *icache_load(uint32_t inum);
+  void write_inode(icache_entry *e);
+  void write_expired();
+  void expirer();
+  void touch_atime(uint32_t inum, struct inode *ino);
+
   struct inode* get_inode(uint32_t inum);
   void put_inode(uint32_t inum, struct inode *ino);
+  void release_inode(struct inode *ino);
+  void get_blocks(struct inode *ino, int start, int n, blockid_t *ids);
+  void pcache_get(blockid_t id, blockid_t *ptrs);
+  void pcache_put(blockid_t id, const blockid_t *ptrs);
+  void pcache_free(blockid_t id);
+  blockid_t map_node(struct inode *ino, int l, int h, uint32_t j, bool alloc);
+  void set_blocks(struct inode *ino, int start, int n, const blockid_t *ids);
+  void trunc_blocks(struct inode *ino, int n, int org_n);
+  void ext_get_blocks(struct inode *ino, int start, int n, blockid_t *ids);
+  void ext_set_blocks(struct inode *ino, int start, int n,
+                      const blockid_t *ids);
+  void ext_trunc_blocks(struct inode *ino, int n);
+  void load_extents(struct inode *ino, std::vector<extent_t> &ext);
+  void store_extents(struct inode *ino, const std::vector<extent_t> &ext);
+  void alloc_blocks(struct inode *ino, int start, int n, blockid_t *ids,
+                    const struct iovec *iov);
+  void uninline(struct inode *ino);
+  void read_data(blockid_t *ids, int n, struct iovec *iov);
+  void write_data(blockid_t *ids, int n, struct iovec *iov);
 
  public:
-  inode_manager();
+  inode_manager(int atime_policy = extent_protocol::STRICTATIME);
   ~inode_manager();
-  uint32_t alloc_inode(uint32_t type);
+  uint32_t alloc_inode(uint32_t type, unsigned short flags);
   void free_inode(uint32_t inum);
   void read_file(uint32_t inum, char **buf, int *size);
-  void write_file(uint32_t inum, const char *buf, int size);
+  void read_range(uint32_t inum, unsigned int off, unsigned int len,
+                  char **buf, int *size);
+  extent_protocol::status write_file(uint32_t inum, const char *buf,
+                                     int size);
+  extent_protocol::status write_range(uint32_t inum, unsigned int off,
+                                      const char *buf, unsigned int len,
+                                      unsigned int mtime);
+  extent_protocol::status truncate(uint32_t inum, unsigned int size);
+  extent_protocol::status seek(uint32_t inum, unsigned int off, int whence,
+                               unsigned int &pos);
   void remove_file(uint32_t inum);
   void getattr(uint32_t inum, extent_protocol::attr &a);
+  void statfs(extent_protocol::fsstat &s);
+  void sync();
 };
 
 #endif
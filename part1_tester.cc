@@ -101,8 +101,10 @@ int test_indirect()
     printf("begin test indirect\n");
     srand((unsigned)time(NULL));
 
+    // every other file is extent-mapped
     for (i = 0; i < FILE_NUM; i++) {
-        if (ec->create(extent_protocol::T_FILE, id_list[i]) != extent_protocol::OK) {
+        if (ec->create(extent_protocol::T_FILE, id_list[i],
+                    i % 2 ? extent_protocol::EXTENTS : 0) != extent_protocol::OK) {
             printf("error create, return not OK\n");
             return 1;
         }
@@ -232,8 +234,77 @@ int test_remove()
     return 0;
 }
 
+// Check one seek on a sparse file: want is the expected position, or
+// -1 if the seek should fail with NOENT.
+static int check_seek(extent_protocol::extentid_t id, unsigned int off,
+        int whence, long long want)
+{
+    unsigned int pos = 0;
+    extent_protocol::status ret = ec->seek(id, off, whence, pos);
+
+    if (want < 0 ? ret == extent_protocol::NOENT
+            : ret == extent_protocol::OK && pos == want)
+        return 0;
+    printf("[TEST_ERROR]: seek %s from %u: status %d pos %u, expected %lld\n",
+            whence == SEEK_DATA ? "SEEK_DATA" : "SEEK_HOLE", off, ret, pos,
+            want);
+    return 1;
+}
+
+int test_seek(uint32_t flags)
+{
+    extent_protocol::extentid_t a, b;
+    std::string data(1024, 'x');
+    int err = 0;
+
+    printf("========== begin test seek%s ==========\n",
+            flags & extent_protocol::EXTENTS ? " (extents)" : "");
+    // a: data [0, 1024), hole, data [5120, 6144), hole up to 10240
+    // b: hole [0, 2048), data [2048, 2560), hole up to 4096
+    if (ec->create(extent_protocol::T_FILE, a, flags) != extent_protocol::OK ||
+        ec->create(extent_protocol::T_FILE, b, flags) != extent_protocol::OK) {
+        iprint("error create, return not OK\n");
+        return 1;
+    }
+    if (ec->write_range(a, 0, data) != extent_protocol::OK ||
+        ec->write_range(a, 5120, data) != extent_protocol::OK ||
+        ec->truncate(a, 10240) != extent_protocol::OK ||
+        ec->truncate(b, 4096) != extent_protocol::OK ||
+        ec->write_range(b, 2048, data.substr(0, 512)) != extent_protocol::OK) {
+        iprint("error writing sparse file, return not OK\n");
+        return 2;
+    }
+
+    // at the start
+    err |= check_seek(a, 0, SEEK_DATA, 0);
+    err |= check_seek(a, 0, SEEK_HOLE, 1024);
+    err |= check_seek(b, 0, SEEK_DATA, 2048);
+    err |= check_seek(b, 0, SEEK_HOLE, 0);
+    // in the middle
+    err |= check_seek(a, 1500, SEEK_DATA, 5120);
+    err |= check_seek(a, 5200, SEEK_DATA, 5200);
+    err |= check_seek(a, 5200, SEEK_HOLE, 6144);
+    err |= check_seek(a, 7000, SEEK_HOLE, 7000);
+    err |= check_seek(a, 7000, SEEK_DATA, -1);
+    err |= check_seek(b, 2100, SEEK_HOLE, 2560);
+    // at and past EOF
+    err |= check_seek(a, 10240, SEEK_DATA, -1);
+    err |= check_seek(a, 10240, SEEK_HOLE, -1);
+    err |= check_seek(b, 9000, SEEK_DATA, -1);
+    err |= check_seek(b, 9000, SEEK_HOLE, -1);
+
+    ec->remove(a);
+    ec->remove(b);
+    if (err)
+        return 3;
+    printf("========== pass test seek ==========\n");
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
+    int failed = 0;
+
     if (argc != 1) {
         printf("Usage: ./part1_tester\n");
         return 1;
@@ -249,9 +320,12 @@ int main(int argc, char *argv[])
         goto test_finish;
     if (test_indirect() != 0)
         goto test_finish;
+    // SEEK_DATA/SEEK_HOLE is not scored, but a failure fails the run
+    if (test_seek(0) != 0 || test_seek(extent_protocol::EXTENTS) != 0)
+        failed = 1;
 
 test_finish:
     printf("---------------------------------\n");
     printf("Part1 score is : %d/100\n", total_score);
-    return 0;
+    return failed;
 }
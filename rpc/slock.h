@@ -14,4 +14,19 @@ struct ScopedLock {
 			VERIFY(pthread_mutex_unlock(m_)==0);
 		}
 };
+
+struct ScopedRWLock {
+	private:
+		pthread_rwlock_t *l_;
+	public:
+		ScopedRWLock(pthread_rwlock_t *l, bool exclusive): l_(l) {
+			if (exclusive)
+				VERIFY(pthread_rwlock_wrlock(l_)==0);
+			else
+				VERIFY(pthread_rwlock_rdlock(l_)==0);
+		}
+		~ScopedRWLock() {
+			VERIFY(pthread_rwlock_unlock(l_)==0);
+		}
+};
 #endif  /*__SCOPED_LOCK__*/